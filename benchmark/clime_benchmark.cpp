@@ -0,0 +1,513 @@
+#include "clime.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef CLIME_HAS_SHARED_MEMORY
+    #include <sys/wait.h>
+#endif
+
+// Measures throughput and latency of clime::message_manager, clime::timer and clime::future. The results of different
+// releases can be compared when running on the same machine, e.g. clime_benchmark 1 for a short run. Throughput
+// benchmarks are repeated and print the median, so that a single disturbed run does not decide a comparison.
+
+using bench_clock = std::chrono::steady_clock;
+
+std::size_t repetitions = 5;     // of each throughput benchmark
+bool        pinned      = false; // producer and handler threads run on cores of their own (as far as there are enough)
+
+struct ping
+{
+    bench_clock::time_point sent;
+};
+
+struct pong
+{
+    bench_clock::time_point sent;
+};
+
+// the same as ping and pong, but receivers spin before they sleep
+struct spin_ping
+{
+    bench_clock::time_point sent;
+};
+
+struct spin_pong
+{
+    bench_clock::time_point sent;
+};
+
+template <>
+struct clime::wait_policy<spin_ping> : clime::spin_wait_policy<clime::wait_strategy::adaptive>
+{
+};
+
+template <>
+struct clime::wait_policy<spin_pong> : clime::spin_wait_policy<clime::wait_strategy::adaptive>
+{
+};
+
+template <int Id>
+struct payload
+{
+    std::uint64_t value;
+};
+
+// the same as payload<0>, but with a sharded queue
+template <>
+struct clime::queue_policy<payload<5>> : clime::sharded_queue_policy<4>
+{
+};
+
+// answered in place with request and add_responder
+using ping_call = clime::call<ping, pong>;
+
+// the same as payload<0>, but without the checks for loggers and queue lengths
+template <>
+struct clime::feature_policy<payload<6>> : clime::features<clime::no_logging, clime::no_backpressure>
+{
+};
+
+struct delayed
+{
+    bench_clock::time_point due;
+};
+
+#ifdef CLIME_HAS_SHARED_MEMORY
+// ping and pong between two processes
+struct shm_ping
+{
+    bench_clock::time_point sent;
+};
+
+struct shm_pong
+{
+    bench_clock::time_point sent;
+};
+
+struct shm_ping_segment
+{
+    static constexpr const char* name = "/clime_benchmark_ping";
+};
+
+struct shm_pong_segment
+{
+    static constexpr const char* name = "/clime_benchmark_pong";
+};
+
+template <>
+struct clime::storage_policy<shm_ping> : clime::inline_storage
+{
+};
+
+template <>
+struct clime::storage_policy<shm_pong> : clime::inline_storage
+{
+};
+
+template <>
+struct clime::queue_policy<shm_ping> : clime::shared_memory_queue_policy<1024, shm_ping_segment>
+{
+};
+
+template <>
+struct clime::queue_policy<shm_pong> : clime::shared_memory_queue_policy<1024, shm_pong_segment>
+{
+};
+#endif
+
+#ifdef CLIME_HAS_JOURNAL
+// written to memory-mapped files
+struct journaled
+{
+    std::uint64_t value[8];
+};
+
+struct journal_files
+{
+    static constexpr const char* path = "/tmp/clime_benchmark_journal";
+};
+
+template <>
+struct clime::storage_policy<journaled> : clime::inline_storage
+{
+};
+
+template <>
+struct clime::queue_policy<journaled> : clime::journaled_queue_policy<65536, journal_files, 4096>
+{
+};
+#endif
+
+// prints percentiles of durations (in microseconds), latencies gets sorted
+void print_latencies(const std::string& name, std::vector<bench_clock::duration>& latencies)
+{
+    if (latencies.empty())
+    {
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](double share)
+    {
+        const auto index = static_cast<std::size_t>(share * static_cast<double>(latencies.size() - 1));
+        return std::chrono::duration<double, std::micro>(latencies[index]).count();
+    };
+
+    std::cout << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(2)
+              << " p50 " << std::setw(9) << percentile(0.5)
+              << " p90 " << std::setw(9) << percentile(0.9)
+              << " p99 " << std::setw(9) << percentile(0.99)
+              << " p99.9 " << std::setw(9) << percentile(0.999)
+              << " max " << std::setw(9) << percentile(1.0) << " us" << std::endl;
+}
+
+void print_throughput(const std::string& name, std::size_t messages, bench_clock::duration elapsed)
+{
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << static_cast<double>(messages) / seconds << " msgs/s" << std::endl;
+}
+
+// Runs benchmark, which returns messages per second, repetitions times and prints the median and the range.
+template <typename Benchmark>
+void repeat_throughput(const std::string& name, Benchmark benchmark)
+{
+    std::vector<double> results;
+    for (std::size_t i = 0; i < repetitions; ++i)
+    {
+        results.push_back(benchmark());
+    }
+    std::sort(results.begin(), results.end());
+
+    std::cout << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << results[results.size() / 2] << " msgs/s (min " << results.front() << ", max " << results.back() << ")" << std::endl;
+}
+
+double messages_per_second(std::size_t messages, bench_clock::duration elapsed)
+{
+    return static_cast<double>(messages) / std::chrono::duration<double>(elapsed).count();
+}
+
+// the options of the thread with the given number if pinned is set, the threads of a benchmark are numbered from 0
+clime::thread_options thread_placement(std::size_t thread)
+{
+    clime::thread_options options;
+    if (pinned)
+    {
+        options.cpus.push_back(static_cast<unsigned int>(thread % std::max(1u, std::thread::hardware_concurrency())));
+    }
+    return options;
+}
+
+// A handler answers each ping with a pong, the main thread measures the round trip time.
+template <typename Ping = ping, typename Pong = pong>
+void benchmark_ping_pong(std::size_t round_trips, const std::string& name = "ping-pong round trip")
+{
+    clime::message_manager<Ping, Pong> mm;
+    mm.template add_handler<Ping>([&](std::shared_ptr<Ping> msg)
+                                  { mm.send_message(std::make_shared<Pong>(Pong{msg->sent})); });
+
+    std::vector<bench_clock::duration> latencies;
+    latencies.reserve(round_trips);
+
+    for (std::size_t i = 0; i < round_trips; ++i)
+    {
+        mm.send_message(std::make_shared<Ping>(Ping{bench_clock::now()}));
+        auto reply = mm.template receive_message<Pong>(true);
+        latencies.push_back(bench_clock::now() - reply->sent);
+    }
+
+    print_latencies(name, latencies);
+}
+
+// Like benchmark_ping_pong, but the pong is the reply to a request.
+void benchmark_request(std::size_t round_trips)
+{
+    clime::message_manager<ping_call> mm;
+    mm.add_responder<ping, pong>([](const ping& msg)
+                                 { return pong{msg.sent}; });
+
+    std::vector<bench_clock::duration> latencies;
+    latencies.reserve(round_trips);
+
+    for (std::size_t i = 0; i < round_trips; ++i)
+    {
+        auto reply = mm.request<ping, pong>(ping{bench_clock::now()}).get();
+        latencies.push_back(bench_clock::now() - reply->sent);
+    }
+
+    print_latencies("request-reply round trip", latencies);
+}
+
+#ifdef CLIME_HAS_SHARED_MEMORY
+// Like benchmark_ping_pong, but the handler runs in a child process and the messages are passed in shared memory.
+void benchmark_shared_memory_ping_pong(std::size_t round_trips)
+{
+    clime::remove_shared_memory(shm_ping_segment::name);
+    clime::remove_shared_memory(shm_pong_segment::name);
+
+    const pid_t child = fork();
+    if (child == 0)
+    {
+        clime::message_manager<shm_ping, shm_pong> mm;
+        for (std::size_t i = 0; i < round_trips; ++i)
+        {
+            auto msg = mm.receive_message<shm_ping>(true);
+            mm.send_message(shm_pong{msg->sent});
+        }
+        std::_Exit(0);
+    }
+
+    clime::message_manager<shm_ping, shm_pong> mm;
+    std::vector<bench_clock::duration>         latencies;
+    latencies.reserve(round_trips);
+
+    for (std::size_t i = 0; i < round_trips; ++i)
+    {
+        mm.send_message(shm_ping{bench_clock::now()});
+        auto reply = mm.receive_message<shm_pong>(true);
+        latencies.push_back(bench_clock::now() - reply->sent);
+    }
+    waitpid(child, nullptr, 0);
+
+    print_latencies("ping-pong round trip between processes", latencies);
+    clime::remove_shared_memory(shm_ping_segment::name);
+    clime::remove_shared_memory(shm_pong_segment::name);
+}
+#endif
+
+#ifdef CLIME_HAS_JOURNAL
+// Appends messages of 64 bytes to the journal, syncing every 4096 messages, and receives them afterwards.
+void benchmark_journal(std::size_t messages)
+{
+    clime::remove_journal(journal_files::path);
+    {
+        clime::message_manager<journaled> mm;
+
+        auto start = bench_clock::now();
+        for (std::size_t i = 0; i < messages; ++i)
+        {
+            mm.send_message(journaled{{i}});
+        }
+        mm.sync_journal<journaled>();
+        print_throughput("journal append (64 bytes, msync per 4096)", messages, bench_clock::now() - start);
+
+        start = bench_clock::now();
+        while (mm.receive_message<journaled>())
+        {
+        }
+        mm.acknowledge<journaled>();
+        print_throughput("journal receive and acknowledge", messages, bench_clock::now() - start);
+    }
+    clime::remove_journal(journal_files::path);
+}
+#endif
+
+// producers threads send messages of one type that are handled by consumers handler threads
+template <typename MessageType = payload<0>>
+double run_throughput(std::size_t producers, std::size_t consumers, std::size_t messages, unsigned int max_queued_messages)
+{
+    clime::message_manager<MessageType> mm;
+    std::atomic<std::size_t>            received{0};
+
+    for (std::size_t i = 0; i < consumers; ++i)
+    {
+        clime::handler_options options;
+        options.thread = thread_placement(producers + i);
+        mm.template add_handler<MessageType>([&](std::shared_ptr<MessageType>)
+                                             { ++received; },
+                                             options);
+    }
+
+    const auto               start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < producers; ++i)
+    {
+        threads.emplace_back([&, i]
+                             {
+                                 static_cast<void>(clime::apply_thread_options(thread_placement(i)));
+                                 for (std::size_t n = i; n < messages; n += producers)
+                                 {
+                                     mm.send_message(std::make_shared<MessageType>(MessageType{n}), max_queued_messages);
+                                 } });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    while (received < messages)
+    {
+        std::this_thread::yield();
+    }
+    return messages_per_second(messages, bench_clock::now() - start);
+}
+
+template <typename MessageType = payload<0>>
+void benchmark_throughput(std::size_t producers, std::size_t consumers, std::size_t messages, unsigned int max_queued_messages, const std::string& name)
+{
+    repeat_throughput(name, [=]
+                      { return run_throughput<MessageType>(producers, consumers, messages, max_queued_messages); });
+}
+
+// every message type has its own producer and handler, so they should not slow down each other
+double run_many_types(std::size_t messages)
+{
+    clime::message_manager<payload<1>, payload<2>, payload<3>, payload<4>> mm;
+    std::atomic<std::size_t>                                               received{0};
+    clime::handler_options                                                 options[4];
+    for (std::size_t i = 0; i < 4; ++i)
+    {
+        options[i].thread = thread_placement(4 + i);
+    }
+
+    mm.add_handler<payload<1>>([&](std::shared_ptr<payload<1>>)
+                               { ++received; },
+                               options[0]);
+    mm.add_handler<payload<2>>([&](std::shared_ptr<payload<2>>)
+                               { ++received; },
+                               options[1]);
+    mm.add_handler<payload<3>>([&](std::shared_ptr<payload<3>>)
+                               { ++received; },
+                               options[2]);
+    mm.add_handler<payload<4>>([&](std::shared_ptr<payload<4>>)
+                               { ++received; },
+                               options[3]);
+
+    auto send = [&](auto type, std::size_t thread)
+    {
+        using MessageType = decltype(type);
+        static_cast<void>(clime::apply_thread_options(thread_placement(thread)));
+        for (std::size_t n = 0; n < messages / 4; ++n)
+        {
+            mm.send_message(std::make_shared<MessageType>(MessageType{n}));
+        }
+    };
+
+    const auto  start = bench_clock::now();
+    std::thread t1(send, payload<1>{}, 0);
+    std::thread t2(send, payload<2>{}, 1);
+    std::thread t3(send, payload<3>{}, 2);
+    std::thread t4(send, payload<4>{}, 3);
+    t1.join();
+    t2.join();
+    t3.join();
+    t4.join();
+
+    while (received < messages / 4 * 4)
+    {
+        std::this_thread::yield();
+    }
+    return messages_per_second(messages / 4 * 4, bench_clock::now() - start);
+}
+
+void benchmark_many_types(std::size_t messages)
+{
+    repeat_throughput("4 types, 4 producers, 4 handlers", [=]
+                      { return run_many_types(messages); });
+}
+
+// Schedules messages with random delays of up to max_delay and measures how late they are received. The time to
+// schedule them shows how the timer scales with the number of pending messages.
+void benchmark_delayed(std::size_t messages, std::chrono::milliseconds max_delay)
+{
+    clime::message_manager<delayed>    mm;
+    std::vector<bench_clock::duration> lateness;
+    std::mutex                         lateness_mutex;
+    std::atomic<std::size_t>           received{0};
+
+    lateness.reserve(messages);
+    mm.add_handler<delayed>([&](std::shared_ptr<delayed> msg)
+                            {
+                                const auto late = bench_clock::now() - msg->due;
+                                std::lock_guard<std::mutex> lock(lateness_mutex);
+                                lateness.push_back(late);
+                                ++received; });
+
+    std::mt19937                            random(42);
+    std::uniform_int_distribution<long long> delay_us(0, std::chrono::duration_cast<std::chrono::microseconds>(max_delay).count());
+
+    const auto start = bench_clock::now();
+    for (std::size_t i = 0; i < messages; ++i)
+    {
+        const auto delay = std::chrono::microseconds(delay_us(random));
+        mm.send_message(std::make_shared<delayed>(delayed{bench_clock::now() + delay}), delay);
+    }
+    const auto scheduled = bench_clock::now() - start;
+
+    while (received < messages)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    const std::string name = std::to_string(messages) + " delayed messages";
+    print_throughput(name + " (scheduling)", messages, scheduled);
+    std::lock_guard<std::mutex> lock(lateness_mutex);
+    print_latencies(name + " (lateness)", lateness);
+}
+
+// creation of a future including running its function on the default executor and waiting for the result
+void benchmark_future(std::size_t futures)
+{
+    std::vector<bench_clock::duration> latencies;
+    latencies.reserve(futures);
+
+    const auto start = bench_clock::now();
+    for (std::size_t i = 0; i < futures; ++i)
+    {
+        const auto           created = bench_clock::now();
+        clime::future<int> f       = [i]()
+        { return static_cast<int>(i); };
+        static_cast<void>(f.get());
+        latencies.push_back(bench_clock::now() - created);
+    }
+
+    print_throughput("future create and get", futures, bench_clock::now() - start);
+    print_latencies("future create and get", latencies);
+}
+
+int main(int argc, char** argv)
+{
+    const std::size_t scale = argc > 1 ? std::max(1, std::atoi(argv[1])) : 10; // multiplies the number of messages
+    repetitions             = argc > 2 ? std::max(1, std::atoi(argv[2])) : repetitions;
+    pinned                  = argc > 3 && std::string(argv[3]) == "pinned";
+    if (argc > 4 || (argc > 3 && !pinned))
+    {
+        std::cout << "Usage: clime_benchmark [scale] [repetitions] [pinned]" << std::endl;
+        return 1;
+    }
+
+    std::cout << "hardware threads: " << std::thread::hardware_concurrency() << ", scale: " << scale << ", repetitions: " << repetitions
+              << (pinned ? ", pinned" : "") << std::endl
+              << std::endl;
+
+    benchmark_ping_pong(1000 * scale);
+    benchmark_ping_pong<spin_ping, spin_pong>(1000 * scale, "ping-pong round trip, adaptive spinning");
+    benchmark_request(1000 * scale);
+#ifdef CLIME_HAS_SHARED_MEMORY
+    benchmark_shared_memory_ping_pong(1000 * scale);
+#endif
+    benchmark_throughput(1, 1, 20000 * scale, 0, "1 producer, 1 handler");
+    benchmark_throughput(4, 1, 20000 * scale, 0, "4 producers, 1 handler");
+    benchmark_throughput(4, 4, 20000 * scale, 0, "4 producers, 4 handlers");
+    benchmark_throughput<payload<5>>(4, 4, 20000 * scale, 0, "4 producers, 4 handlers, 4 shards");
+    benchmark_throughput<payload<6>>(1, 1, 20000 * scale, 0, "1 producer, 1 handler, lean features");
+    benchmark_many_types(20000 * scale);
+#ifdef CLIME_HAS_JOURNAL
+    benchmark_journal(20000 * scale);
+#endif
+    benchmark_throughput(1, 1, 20000 * scale, 16, "1 producer, 1 handler, max 16 queued");
+    benchmark_throughput(4, 4, 20000 * scale, 16, "4 producers, 4 handlers, max 16 queued");
+    benchmark_delayed(100 * scale, std::chrono::milliseconds(100));
+    benchmark_delayed(1000 * scale, std::chrono::milliseconds(100));
+    benchmark_delayed(10000 * scale, std::chrono::milliseconds(100));
+    benchmark_future(1000 * scale);
+
+    return 0;
+}
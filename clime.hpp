@@ -28,21 +28,50 @@ SOFTWARE.
 #ifndef CLIME_HPP
 #define CLIME_HPP
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <climits>
 #include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
-#include <future>
+#include <iterator>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
 #include <queue>
+#include <stdexcept>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <variant>
+#include <vector>
 
-#if __cplusplus < 201402L
-    #error You need at least C++14 for clime.hpp. Please check example/CMakeLists.txt on how to set compiler options. Reason: This code uses std::get<T> to extract the elements of a std::tuple whose type is T.
+#if __cplusplus < 201703L
+    #error You need at least C++17 for clime.hpp. Please check example/CMakeLists.txt on how to set compiler options. Reason: This code uses std::optional and std::variant to store and return messages, and if constexpr to select the code paths of the queue and storage policies.
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+    #include <span>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    #include <coroutine>
+    #define CLIME_HAS_COROUTINES
 #endif
 
 #ifdef _WIN32
@@ -62,6 +91,28 @@ SOFTWARE.
     #include <sys/prctl.h>
 #endif
 
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <linux/futex.h>
+    #include <linux/mempolicy.h>
+    #include <pthread.h>
+    #include <sched.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+    #define CLIME_HAS_SHARED_MEMORY
+    #define CLIME_HAS_JOURNAL
+#endif
+
+#ifndef CLIME_CACHE_LINE_SIZE
+    #if defined(__APPLE__) && defined(__aarch64__)
+        #define CLIME_CACHE_LINE_SIZE 128
+    #else
+        #define CLIME_CACHE_LINE_SIZE 64
+    #endif
+#endif
+
 #ifdef _MSC_VER
     #define CLIME_DEMANGLED_CLASS_NAME(demangling_status) typeid(*this).name()
 #else
@@ -71,6 +122,24 @@ SOFTWARE.
 
 namespace clime
 {
+    // Size that separates data written by different threads, so that they do not invalidate each other's cache lines
+    // (false sharing). std::hardware_destructive_interference_size is not used, because its value may change with
+    // compiler flags, which would change the layout of shared memory segments between processes.
+    constexpr std::size_t cache_line_size = CLIME_CACHE_LINE_SIZE;
+
+    // Tells the CPU that the thread spins, which saves power and leaves more resources to the other hardware thread of
+    // the same core.
+    inline void cpu_pause()
+    {
+#if defined(_MSC_VER)
+        YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
 #ifdef _WIN32
     #pragma pack(push, 8)
     typedef struct tagTHREADNAME_INFO
@@ -132,412 +201,6457 @@ namespace clime
     }
 #endif
 
-    template <typename... MessageTypes>
-    class message_manager
+    // Placement and scheduling of a thread, see apply_thread_options.
+    struct thread_options
     {
-    private:
-        template <typename MessageType>
-        class message_handler
+        enum class scheduling
         {
-        public:
-            message_handler(message_manager&                                            msg_manager,
-                            const std::function<void(const std::exception& exception)>& on_exception = nullptr,
-                            const std::string&                                          thread_name  = {})
-                : msg_manager_(msg_manager)
-                , on_exception_(on_exception)
-                , thread_name_(thread_name.empty() ? CLIME_DEMANGLED_CLASS_NAME(demangling_status_) : thread_name)
-            {
-            }
-
-            virtual ~message_handler()
-            {
-                try
-                {
-                    {
-                        std::lock_guard<std::mutex> lock(msg_manager_.mutex_messages_);
-                        msg_manager_.running_ = false;
-                    }
-                    msg_manager_.cv_.notify_one();
-
-                    if (thread_.joinable())
-                    {
-                        thread_.join();
-                    }
-                }
-                catch (const std::exception& ex)
-                {
-                    if (on_exception_)
-                    {
-                        on_exception_(ex);
-                    }
-                }
-            }
+            normal,     // the default time-sharing scheduler
+            fifo,       // real-time, runs until it blocks or a thread with a higher priority is ready (SCHED_FIFO)
+            round_robin // real-time with time slices among threads of the same priority (SCHED_RR)
+        };
 
-            void start_thread(std::function<void(std::shared_ptr<MessageType> message_type)> on_message,
-                              const std::function<void()>&                                   on_idle,
-                              const std::function<void()>&                                   on_exit)
-            {
-                thread_ = std::thread([this, on_message, on_idle, on_exit]
-                                      {
-                    auto pos = thread_name_.rfind("message_handler");
-                    if (pos != std::string::npos)
-                    {
-                        thread_name_ = thread_name_.substr(pos);
-                    }
+        std::vector<unsigned int> cpus;         // cores the thread may run on, empty means all
+        int                       numa_node{-1}; // runs the thread on the cores of this node and prefers its memory, -1 means any
+        scheduling                policy{scheduling::normal};
+        int                       priority{0}; // of the real-time policies, e.g. 1 (lowest) to 99 on Linux, 0 means the lowest
 
-                    set_thread_name(thread_name_.c_str());
-                    run(on_message, on_idle);
-                    if (on_exit)
-                    {
-                        on_exit();
-                    } });
-            }
+        bool empty() const { return cpus.empty() && numa_node < 0 && policy == scheduling::normal; }
+    };
 
-        protected:
-            message_manager&                                     msg_manager_;
-            std::function<void(const std::exception& exception)> on_exception_;
-            std::string                                          thread_name_;
-            int                                                  demangling_status_{};
-            std::thread                                          thread_;
+#ifdef __linux__
+    // cores of a NUMA node, empty if there is no such node
+    inline std::vector<unsigned int> numa_node_cpus(int node)
+    {
+        std::vector<unsigned int> result;
+        char                      path[64];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        std::FILE* file = std::fopen(path, "r");
+        if (file == nullptr)
+        {
+            return result;
+        }
 
-            void run(std::function<void(std::shared_ptr<MessageType> message_type)> on_message,
-                     const std::function<void()>&                                   on_idle)
+        char line[4096] = {};
+        if (std::fgets(line, sizeof(line), file) != nullptr)
+        {
+            // e.g. "0-3,8-11"
+            for (char* pos = line; *pos >= '0' && *pos <= '9';)
             {
-                const std::runtime_error unknown_exception("unknown exception");
-
-                while (msg_manager_.running_)
+                const auto first = static_cast<unsigned int>(std::strtoul(pos, &pos, 10));
+                const auto last  = *pos == '-' ? static_cast<unsigned int>(std::strtoul(pos + 1, &pos, 10)) : first;
+                for (unsigned int cpu = first; cpu <= last; ++cpu)
                 {
-                    try
-                    {
-                        auto incoming_message = msg_manager_.template receive_message<MessageType>(on_idle == nullptr);
-
-                        if (msg_manager_.running_)
-                        {
-                            if (incoming_message)
-                            {
-                                on_message(incoming_message);
-                            }
-                            else if (on_idle)
-                            {
-                                on_idle();
-                            }
-                        }
-                    }
-                    catch (const std::exception& ex)
-                    {
-                        if (on_exception_ && msg_manager_.running_)
-                        {
-                            on_exception_(ex);
-                        }
-                    }
-                    catch (...)
-                    {
-                        if (on_exception_ && msg_manager_.running_)
-                        {
-                            on_exception_(unknown_exception);
-                        }
-                    }
+                    result.push_back(cpu);
                 }
+                pos += *pos == ',' ? 1 : 0;
             }
-        };
+        }
+        std::fclose(file);
+        return result;
+    }
+#endif
 
-    public:
-        message_manager()
-            : message_handler_(std::make_shared<std::tuple<std::list<std::shared_ptr<message_handler<MessageTypes>>>...>>())
+    // Applies options to the calling thread and returns the error of the first setting that failed, e.g. because
+    // real-time scheduling needs privileges. The other settings are applied nevertheless. macOS cannot pin threads to
+    // cores, Windows only supports the first 64 cores and maps the real-time policies to thread priorities.
+    inline std::error_code apply_thread_options(const thread_options& options)
+    {
+        std::error_code result;
+        auto            fail = [&](int error)
         {
-        }
+            if (!result)
+            {
+                result = std::error_code(error, std::generic_category());
+            }
+        };
 
-        virtual ~message_manager()
+#ifdef _WIN32
+        DWORD_PTR mask = 0;
+        for (const unsigned int cpu : options.cpus)
         {
-            dispose();
+            mask |= cpu < sizeof(mask) * 8 ? DWORD_PTR(1) << cpu : 0;
         }
-
-        void dispose()
+        if (options.numa_node >= 0)
         {
-            clear_all_loggers();
-            clear_all_messages();
+            ULONGLONG node_mask = 0;
+            if (GetNumaNodeProcessorMask(static_cast<UCHAR>(options.numa_node), &node_mask) && node_mask != 0)
             {
-                std::lock_guard<std::mutex> lock(mutex_messages_);
-                running_ = false;
+                mask = options.cpus.empty() ? static_cast<DWORD_PTR>(node_mask) : mask & static_cast<DWORD_PTR>(node_mask);
             }
-            cv_.notify_one();
-            message_handler_.reset();
-        }
-
-        template <typename MessageType>
-        void clear_messages()
-        {
-            std::lock_guard<std::mutex>               lock(mutex_messages_);
-            std::queue<std::shared_ptr<MessageType>>& message_queue = std::get<std::queue<std::shared_ptr<MessageType>>>(messages_);
-            while (!message_queue.empty())
+            else
             {
-                message_queue.pop();
+                fail(EINVAL);
             }
         }
-
-        void clear_all_messages()
-        {
-            clear_all_messages_helper(std::index_sequence_for<MessageTypes...>());
-        }
-
-        template <typename MessageType>
-        std::size_t size() const
+        if ((!options.cpus.empty() || options.numa_node >= 0) && (mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0))
         {
-            using QueueType = std::queue<std::shared_ptr<MessageType>>;
-            std::lock_guard<std::mutex> lock(mutex_messages_);
-            return std::get<QueueType>(messages_).size();
+            fail(EINVAL);
         }
 
-        std::size_t total_size() const
+        if (options.policy != thread_options::scheduling::normal &&
+            !SetThreadPriority(GetCurrentThread(), options.policy == thread_options::scheduling::fifo ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST))
         {
-            return total_size_helper(std::index_sequence_for<MessageTypes...>());
+            fail(EPERM);
         }
-
-        template <typename MessageType>
-        void send_message(std::shared_ptr<MessageType> msg, unsigned int max_queued_messages = 0)
+#else
+    #ifdef __linux__
+        std::vector<unsigned int> cpus = options.cpus;
+        if (options.numa_node >= 0)
         {
-            using QueueType = std::queue<std::shared_ptr<MessageType>>;
+            const auto node_cpus = numa_node_cpus(options.numa_node);
+            if (node_cpus.empty())
             {
-                std::unique_lock<std::mutex> lock(mutex_messages_);
-                cv_.wait(lock, [&]
-                         { return !running_ || max_queued_messages == 0 || std::get<QueueType>(messages_).size() < max_queued_messages; });
-
-                std::get<QueueType>(messages_).emplace(msg);
+                fail(EINVAL);
             }
-            cv_.notify_one();
-
-            using FunctionType = std::function<void(std::shared_ptr<MessageType>, bool)>;
-            if (std::get<FunctionType>(logger_) != nullptr)
+            else if (cpus.empty())
             {
-                std::get<FunctionType>(logger_)(msg, true);
+                cpus = node_cpus;
             }
-        }
-
-        template <typename MessageType, typename Rep, typename Period>
-        void send_message(std::shared_ptr<MessageType> msg, const std::chrono::duration<Rep, Period>& delay_duration)
-        {
-            std::lock_guard<std::mutex> lock(mutex_future_pool_);
-            std::future<void>*          future            = nullptr;
-            std::size_t                 last_ready_future = future_pool_.size();
-
-            for (std::size_t i = 0; i < future_pool_.size(); ++i)
+            else
             {
-                if (future_pool_[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready)
-                {
-                    if (future == nullptr)
-                    {
-                        future = &future_pool_[i];
-                    }
-                    else
-                    {
-                        last_ready_future = i;
-                    }
-                }
+                cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](unsigned int cpu)
+                                          { return std::find(node_cpus.begin(), node_cpus.end(), cpu) == node_cpus.end(); }),
+                           cpus.end());
             }
 
-            future_pool_.resize(last_ready_future);
-
-            if (future == nullptr)
+            // memory that the thread allocates or touches first, e.g. the buffer of a batch handler, is taken from the node
+            unsigned long node_mask = static_cast<unsigned int>(options.numa_node) < sizeof(node_mask) * 8 ? 1ul << options.numa_node : 0;
+            if (node_mask == 0 || ::syscall(SYS_set_mempolicy, MPOL_PREFERRED, &node_mask, sizeof(node_mask) * 8) != 0)
             {
-                future_pool_.emplace_back();
-                future = &future_pool_.back();
+                fail(node_mask == 0 ? EINVAL : errno);
             }
-
-            *future = std::async(std::launch::async, [msg, delay_duration, this]()
-                                 {
-                                     std::this_thread::sleep_for(delay_duration);
-                                     send_message(msg); });
         }
 
-        template <typename MessageType>
-        std::shared_ptr<MessageType> receive_message(bool wait_for_message = false)
+        if (!options.cpus.empty() || options.numa_node >= 0)
         {
-            using QueueType = std::queue<std::shared_ptr<MessageType>>;
-
-            std::shared_ptr<MessageType> result;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (const unsigned int cpu : cpus)
             {
-                std::unique_lock<std::mutex> lock(mutex_messages_);
-                cv_.wait(lock, [&]
-                         { return !running_ || !wait_for_message || !std::get<QueueType>(messages_).empty(); });
-
-                auto& messages = std::get<QueueType>(messages_);
-
-                if (!messages.empty())
+                if (cpu < CPU_SETSIZE)
                 {
-                    result = messages.front();
-                    messages.pop();
+                    CPU_SET(cpu, &set);
                 }
             }
 
-            cv_.notify_one();
-
-            using FunctionType = std::function<void(std::shared_ptr<MessageType>, bool)>;
-            if (std::get<FunctionType>(logger_) != nullptr && result)
+            const int error = CPU_COUNT(&set) == 0 ? EINVAL : pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (error != 0)
             {
-                std::get<FunctionType>(logger_)(result, false);
+                fail(error);
             }
-
-            return result;
         }
-
-        template <typename MessageType>
-        void set_logger(std::function<void(std::shared_ptr<MessageType>, bool)> logger)
+    #else
+        if (!options.cpus.empty() || options.numa_node >= 0)
         {
-            using FunctionType              = std::function<void(std::shared_ptr<MessageType>, bool)>;
-            std::get<FunctionType>(logger_) = logger;
+            fail(ENOTSUP);
         }
+    #endif
 
-        template <typename MessageType>
-        void add_handler(
-            std::function<void(std::shared_ptr<MessageType> message_type)> on_message,
-            std::function<void(const std::exception& exception)>           on_exception = nullptr,
-            std::function<void()>                                          on_idle      = nullptr,
-            std::function<void()>                                          on_exit      = nullptr,
-            const std::string&                                             thread_name  = "")
+        if (options.policy != thread_options::scheduling::normal)
         {
-            using HandlerListType                 = std::list<std::shared_ptr<message_handler<MessageType>>>;
-            HandlerListType& message_handler_list = std::get<HandlerListType>(*message_handler_);
-            message_handler_list.emplace_back(std::make_shared<message_handler<MessageType>>(*this, on_exception, thread_name));
-            message_handler_list.back()->start_thread(on_message, on_idle, on_exit);
+            const int   policy = options.policy == thread_options::scheduling::fifo ? SCHED_FIFO : SCHED_RR;
+            sched_param param{};
+            param.sched_priority = options.priority != 0 ? options.priority : sched_get_priority_min(policy); // 0 is invalid for real-time policies
+            const int error      = param.sched_priority < sched_get_priority_min(policy) || param.sched_priority > sched_get_priority_max(policy)
+                                       ? EINVAL
+                                       : pthread_setschedparam(pthread_self(), policy, &param);
+            if (error != 0)
+            {
+                fail(error);
+            }
         }
+#endif
+        return result;
+    }
 
-        template <typename MessageType>
-        void clear_handlers()
-        {
-            using HandlerListType                 = std::list<std::shared_ptr<message_handler<MessageType>>>;
-            HandlerListType& message_handler_list = std::get<HandlerListType>(*message_handler_);
-            message_handler_list.clear(); // ends all message_handler threads that handled MessageType
-        }
+#if __cplusplus >= 202002L && __has_include(<span>)
+    template <typename T>
+    using span = std::span<T>;
+#else
+    // minimal replacement of std::span for C++ versions prior to C++20
+    template <typename T>
+    class span
+    {
+    public:
+        using element_type = T;
+        using iterator     = T*;
 
-        void clear_all_loggers()
+        constexpr span() noexcept = default;
+        constexpr span(T* data, std::size_t size) noexcept
+            : data_(data)
+            , size_(size)
         {
-            clear_logger_helper(std::index_sequence_for<MessageTypes...>());
         }
 
-    protected:
-        std::tuple<std::queue<std::shared_ptr<MessageTypes>>...>                                  messages_;
-        std::tuple<std::function<void(std::shared_ptr<MessageTypes>, bool)>...>                   logger_;
-        std::shared_ptr<std::tuple<std::list<std::shared_ptr<message_handler<MessageTypes>>>...>> message_handler_;
-        mutable std::mutex                                                                        mutex_messages_;
-        std::condition_variable                                                                   cv_;
-        std::atomic<bool>                                                                         running_{true};
-        std::mutex                                                                                mutex_future_pool_;
-        std::vector<std::future<void>>                                                            future_pool_;
+        constexpr T*          data() const noexcept { return data_; }
+        constexpr std::size_t size() const noexcept { return size_; }
+        constexpr bool        empty() const noexcept { return size_ == 0; }
+        constexpr T*          begin() const noexcept { return data_; }
+        constexpr T*          end() const noexcept { return data_ + size_; }
+        constexpr T&          operator[](std::size_t i) const { return data_[i]; }
+        constexpr T&          front() const { return data_[0]; }
+        constexpr T&          back() const { return data_[size_ - 1]; }
 
     private:
-        template <std::size_t... Is>
-        void clear_all_messages_helper(std::index_sequence<Is...>)
-        {
-            (clear_messages<MessageTypes>(), ...);
-        }
+        T*          data_{nullptr};
+        std::size_t size_{0};
+    };
+#endif
 
-        template <std::size_t... Is>
-        void clear_logger_helper(std::index_sequence<Is...>)
-        {
-            (clear_logger<MessageTypes>(), ...);
-        }
+    // Queue used by default for every message type. It is not thread safe by itself, message_manager protects it with
+    // the mutex of the message type.
+    template <typename T>
+    class locked_queue
+    {
+    public:
+        static constexpr bool lock_free = false;
 
-        template <typename MessageType>
-        void clear_logger()
+        bool try_push(T& value) // moves from value on success
         {
-            set_logger<MessageType>(nullptr);
+            queue_.push(std::move(value));
+            return true;
         }
 
-        template <std::size_t... Is>
-        std::size_t total_size_helper(std::index_sequence<Is...>) const
+        bool try_pop(T& value)
         {
-            return (size<MessageTypes>() + ...);
+            if (queue_.empty())
+            {
+                return false;
+            }
+
+            value = std::move(queue_.front());
+            queue_.pop();
+            return true;
         }
+
+        std::size_t size() const { return queue_.size(); }
+        bool        empty() const { return queue_.empty(); }
+
+    private:
+        std::queue<T> queue_;
     };
 
-    template <typename Result>
-    class future
+    // Bounded lock-free ring buffer for exactly one producer thread and one consumer thread.
+    template <typename T, std::size_t Capacity>
+    class spsc_ring
     {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity of spsc_ring must be a power of 2");
+
     public:
-        future() = default;
+        static constexpr bool        lock_free       = true;
+        static constexpr bool        single_consumer = true;
+        static constexpr std::size_t capacity        = Capacity;
 
-        template <typename AsyncOp>
-        future(const AsyncOp& async_op) // NOLINT(google-explicit-constructor)
+        spsc_ring()
+            : slots_(new slot[Capacity])
         {
-            operator=(async_op);
         }
 
-        template <typename AsyncOp>
-        future& operator=(const AsyncOp& async_op)
-        {
-            manager_future_.template clear_handlers<start_op>(); // remove any previous handlers - a future always has only 1 future function
-
-            manager_future_.template add_handler<start_op>([&, async_op](std::shared_ptr<start_op>)
-                                                           { manager_future_.send_message(std::make_shared<Result>(async_op())); });
-
-            manager_future_.send_message(std::make_shared<start_op>());
-
-            manager_future_.template add_handler<Result>([&](std::shared_ptr<Result> result)
-                                                         {
-                                                             {
-                                                                 std::lock_guard<std::mutex> lock(mtx_);
-                                                                 if (!result_)
-                                                                 {
-                                                                     // While the future function was running, result_ may have been set by operator =(const Result& result),
-                                                                     // so we only set result_ if it is not yet initialized.
-                                                                     result_ = result;
-                                                                 }
-                                                             }
-                                                             cv_.notify_one(); });
+        spsc_ring(const spsc_ring&)            = delete;
+        spsc_ring& operator=(const spsc_ring&) = delete;
 
-            return *this;
-        }
-
-        future& operator=(const Result& result) // directly sets results without future function
+        ~spsc_ring()
         {
+            for (std::size_t i = head_.load(); i != tail_.load(); ++i)
             {
-                std::lock_guard<std::mutex> lock(mtx_);
-                result_ = std::make_shared<Result>(result);
+                reinterpret_cast<T*>(slots_[i & (Capacity - 1)].storage)->~T();
             }
-            cv_.notify_one();
-            return *this;
         }
 
-        operator Result() // NOLINT(google-explicit-constructor)
+        bool try_push(T& value) // moves from value on success
         {
-            std::unique_lock<std::mutex> lock(mtx_);
-            cv_.wait(lock, [&]
-                     { return manager_future_.template size<start_op>() == 0 || static_cast<bool>(result_); });
-            return result_ ? *result_ : Result(); // if there is no future function, return default value of its return type
-        }
+            const std::size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) == Capacity)
+            {
+                return false;
+            }
 
-        bool ready()
-        {
-            std::lock_guard<std::mutex> lock(mtx_);
-            return result_;
+            new (slots_[tail & (Capacity - 1)].storage) T(std::move(value));
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
         }
 
-        std::shared_ptr<const Result> get()
+        bool try_pop(T& value)
         {
+            const std::size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire))
             {
-                std::unique_lock<std::mutex> lock(mtx_);
-                cv_.wait(lock, [&]
-                         { return static_cast<bool>(result_); });
+                return false;
             }
-            return result_;
+
+            T* element = reinterpret_cast<T*>(slots_[head & (Capacity - 1)].storage);
+            value      = std::move(*element);
+            element->~T();
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t size() const
+        {
+            const std::size_t head = head_.load(std::memory_order_acquire);
+            return tail_.load(std::memory_order_acquire) - head;
         }
 
+        bool empty() const { return size() == 0; }
+
     private:
-        struct start_op
+        struct slot
         {
+            alignas(T) unsigned char storage[sizeof(T)];
         };
-        message_manager<start_op, Result> manager_future_;
-        std::mutex                        mtx_;
-        std::condition_variable           cv_;
-        std::shared_ptr<const Result>     result_;
+
+        std::unique_ptr<slot[]>                           slots_;
+        alignas(cache_line_size) std::atomic<std::size_t> head_{0}; // written by the consumer
+        alignas(cache_line_size) std::atomic<std::size_t> tail_{0}; // written by the producer
     };
 
+    // Bounded lock-free ring buffer for any number of producer and consumer threads (algorithm of Dmitry Vyukov).
+    template <typename T, std::size_t Capacity>
+    class mpmc_ring
+    {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity of mpmc_ring must be a power of 2");
+
+    public:
+        static constexpr bool        lock_free = true;
+        static constexpr std::size_t capacity  = Capacity;
+
+        mpmc_ring()
+            : slots_(new slot[Capacity])
+        {
+            for (std::size_t i = 0; i < Capacity; ++i)
+            {
+                slots_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        mpmc_ring(const mpmc_ring&)            = delete;
+        mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+        ~mpmc_ring()
+        {
+            for (std::size_t i = dequeue_pos_.load(); i != enqueue_pos_.load(); ++i)
+            {
+                reinterpret_cast<T*>(slots_[i & (Capacity - 1)].storage)->~T();
+            }
+        }
+
+        bool try_push(T& value) // moves from value on success
+        {
+            std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            slot*       s;
+
+            for (;;)
+            {
+                s                        = &slots_[pos & (Capacity - 1)];
+                const std::size_t   seq  = s->sequence.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+
+                if (diff == 0)
+                {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // full
+                }
+                else
+                {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+
+            new (s->storage) T(std::move(value));
+            s->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            slot*       s;
+
+            for (;;)
+            {
+                s                        = &slots_[pos & (Capacity - 1)];
+                const std::size_t   seq  = s->sequence.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // empty
+                }
+                else
+                {
+                    pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+
+            T* element = reinterpret_cast<T*>(s->storage);
+            value      = std::move(*element);
+            element->~T();
+            s->sequence.store(pos + Capacity, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t size() const
+        {
+            const std::size_t dequeue_pos = dequeue_pos_.load(std::memory_order_acquire);
+            const std::size_t enqueue_pos = enqueue_pos_.load(std::memory_order_acquire);
+            return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+        }
+
+        bool empty() const { return size() == 0; }
+
+    private:
+        struct slot
+        {
+            std::atomic<std::size_t> sequence;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+
+        std::unique_ptr<slot[]>                           slots_;
+        alignas(cache_line_size) std::atomic<std::size_t> enqueue_pos_{0};
+        alignas(cache_line_size) std::atomic<std::size_t> dequeue_pos_{0};
+    };
+
+    // A queued message together with the time it was sent (used if CLIME_ENABLE_STATS is defined).
+    template <typename T>
+    struct timestamped
+    {
+        T                                     value;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    // Returns the message that a queue element refers to, for queues that need to look at the message itself.
+    template <typename T>
+    const T& message_of(const T& element)
+    {
+        return element;
+    }
+
+    template <typename T>
+    const T& message_of(const std::shared_ptr<T>& element)
+    {
+        return *element;
+    }
+
+    template <typename T, typename Deleter>
+    const T& message_of(const std::unique_ptr<T, Deleter>& element)
+    {
+        return *element;
+    }
+
+    template <typename T>
+    const auto& message_of(const timestamped<T>& element)
+    {
+        return message_of(element.value);
+    }
+
+    // Queue that consists of Shards sub-queues with a lock of their own, so that several handlers of the same message
+    // type do not contend for a single lock. Each consumer thread prefers its own shard and, if Steal is true, takes
+    // messages from the others when it is empty. Producers choose a shard round-robin or, if Key is not void, by the
+    // hash of Key()(message). Without stealing (affine), shard s belongs to the consumer s % consumers (see
+    // set_consumers), so all messages with the same key are received by one consumer. A consumer that takes over a
+    // shard, because another consumer was added, waits until the previous one has released it (see release), so that
+    // messages with the same key are never handled in parallel.
+    template <typename T, std::size_t Shards, typename Key = void, bool Steal = true>
+    class sharded_queue
+    {
+        static_assert(Shards >= 1, "sharded_queue needs at least one shard");
+        static_assert(Steal || !std::is_void<Key>::value, "sharded_queue without stealing needs a Key");
+
+    public:
+        static constexpr bool        lock_free   = true; // message_manager only locks to wait, the shards lock themselves
+        static constexpr bool        affine      = !Steal;
+        static constexpr std::size_t shards      = Shards;
+        static constexpr std::size_t no_consumer = static_cast<std::size_t>(-1); // receivers that are not bound to shards
+
+        bool try_push(T& value) // moves from value on success
+        {
+            shard&                      s = shards_[producer_shard(value)];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.items.push_back(std::move(value));
+            s.size.store(s.items.size(), std::memory_order_relaxed);
+            return true;
+        }
+
+        // Receivers that are not bound to shards take messages from any shard that no consumer holds.
+        bool try_pop(T& value)
+        {
+            const std::size_t home = Steal ? consumer_shard() : 0;
+            for (std::size_t i = 0; i < Shards; ++i)
+            {
+                if (pop_from((home + i) % Shards, value, no_consumer))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Takes a message from a shard of consumer (affine queues only) and holds the shard until consumer releases it.
+        bool try_pop(T& value, std::size_t consumer)
+        {
+            const std::size_t count = consumers_.load(std::memory_order_acquire);
+            if (consumer == no_consumer || count == 0)
+            {
+                return try_pop(value);
+            }
+            for (std::size_t i = consumer; i < Shards; i += count)
+            {
+                if (pop_from(i, value, consumer))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Must be called by consumer before it receives the next messages, i.e. when it has handled the ones before.
+        // Returns true if a released shard has messages for another consumer.
+        bool release(std::size_t consumer)
+        {
+            bool pending = false;
+            for (std::size_t i = 0; i < Shards; ++i)
+            {
+                shard& s = shards_[i];
+                if (s.holder.load(std::memory_order_relaxed) == consumer)
+                {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    s.holder.store(no_consumer, std::memory_order_relaxed);
+                    pending = pending || (!s.items.empty() && owner_of(i) != consumer);
+                }
+            }
+            return pending;
+        }
+
+        // the consumers that the shards are distributed to, 0 if there is none (then any receiver takes any shard)
+        void set_consumers(std::size_t count)
+        {
+            consumers_.store(count, std::memory_order_release);
+            if (count == 0)
+            {
+                for (auto& s : shards_)
+                {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    s.holder.store(no_consumer, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::size_t owner_of(std::size_t shard) const
+        {
+            const std::size_t count = consumers_.load(std::memory_order_acquire);
+            return count == 0 ? no_consumer : shard % count;
+        }
+
+        // true if consumer would receive a message now
+        bool has_messages_for(std::size_t consumer) const
+        {
+            const std::size_t count = consumers_.load(std::memory_order_acquire);
+            for (std::size_t i = (count == 0 ? 0 : consumer); i < Shards; i += (count == 0 ? 1 : count))
+            {
+                const shard&      s      = shards_[i];
+                const std::size_t holder = s.holder.load(std::memory_order_relaxed);
+                if (s.size.load(std::memory_order_relaxed) != 0 && (holder == no_consumer || holder == consumer))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // removes the first message of the longest shard, e.g. for overflow_policy::drop_oldest
+        bool try_discard(T& value)
+        {
+            std::size_t longest = 0;
+            for (std::size_t i = 1; i < Shards; ++i)
+            {
+                if (shards_[i].size.load(std::memory_order_relaxed) > shards_[longest].size.load(std::memory_order_relaxed))
+                {
+                    longest = i;
+                }
+            }
+
+            for (std::size_t i = 0; i < Shards; ++i)
+            {
+                shard&                      s = shards_[(longest + i) % Shards];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (!s.items.empty())
+                {
+                    value = std::move(s.items.front());
+                    s.items.pop_front();
+                    s.size.store(s.items.size(), std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        std::size_t size() const
+        {
+            std::size_t result = 0;
+            for (const auto& s : shards_)
+            {
+                result += s.size.load(std::memory_order_relaxed);
+            }
+            return result;
+        }
+
+        bool empty() const { return size() == 0; }
+
+        bool empty(std::size_t shard) const { return shards_[shard].size.load(std::memory_order_relaxed) == 0; }
+
+        // shard that a message will be sent to (the queued element or the element of which it is made)
+        template <typename Element>
+        std::size_t shard_of(const Element& value) const
+        {
+            return producer_shard(value);
+        }
+
+        // shard that the calling thread receives from first (queues with stealing)
+        static std::size_t consumer_shard() { return home_shard(); }
+
+    private:
+        struct alignas(cache_line_size) shard
+        {
+            std::mutex               mutex;
+            std::deque<T>            items;
+            std::atomic<std::size_t> size{0};               // read without holding mutex to skip empty shards
+            std::atomic<std::size_t> holder{no_consumer};   // consumer that handles messages of the shard, modified while holding mutex
+        };
+
+        // A shard that another consumer holds is skipped. Only affine queues have holders.
+        bool pop_from(std::size_t index, T& value, std::size_t consumer)
+        {
+            shard& s = shards_[index];
+            if (s.size.load(std::memory_order_relaxed) == 0)
+            {
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(s.mutex);
+            const std::size_t           holder = s.holder.load(std::memory_order_relaxed);
+            if (s.items.empty() || (holder != no_consumer && holder != consumer))
+            {
+                return false;
+            }
+
+            value = std::move(s.items.front());
+            s.items.pop_front();
+            s.size.store(s.items.size(), std::memory_order_relaxed);
+            if (consumer != no_consumer)
+            {
+                s.holder.store(consumer, std::memory_order_relaxed);
+            }
+            return true;
+        }
+
+        template <typename Element>
+        static std::size_t producer_shard(const Element& value)
+        {
+            if constexpr (std::is_void<Key>::value)
+            {
+                static std::atomic<std::size_t> next_thread{0};
+                thread_local std::size_t        next = next_thread++; // no shared counter, each producer has its own
+                return next++ % Shards;
+            }
+            else
+            {
+                const auto key = Key()(message_of(value));
+                return std::hash<std::decay_t<decltype(key)>>()(key) % Shards;
+            }
+        }
+
+        // consumers that are started one after another start with different shards
+        static std::size_t home_shard()
+        {
+            static std::atomic<std::size_t> next_thread{0};
+            thread_local std::size_t        home = next_thread++ % Shards;
+            return home;
+        }
+
+        std::array<shard, Shards> shards_;
+        std::atomic<std::size_t>  consumers_{0}; // of affine queues, see set_consumers
+    };
+
+    // Queue with Lanes FIFO queues for different priorities, Priority()(message) returns the lane of a message (0 is the
+    // highest priority). Messages of the highest non-empty lane are received first, but a lower lane that was skipped
+    // MaxSkips times in a row is served once, so bulk messages still get through while urgent ones keep arriving. Like
+    // locked_queue, it is protected by the mutex of the message type.
+    template <typename T, std::size_t Lanes, typename Priority, std::size_t MaxSkips = 64>
+    class priority_lanes
+    {
+        static_assert(Lanes >= 1, "priority_lanes needs at least one lane");
+
+    public:
+        static constexpr bool        lock_free = false;
+        static constexpr std::size_t lanes     = Lanes;
+
+        bool try_push(T& value) // moves from value on success
+        {
+            const std::size_t lane = static_cast<std::size_t>(Priority()(message_of(value)));
+            lanes_[lane < Lanes ? lane : Lanes - 1].push(std::move(value));
+            ++size_;
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            if (size_ == 0)
+            {
+                return false;
+            }
+
+            std::size_t selected = Lanes;
+            for (std::size_t i = 0; i < Lanes; ++i)
+            {
+                if (!lanes_[i].empty() && (selected == Lanes || skipped_[i] >= MaxSkips))
+                {
+                    selected = i;
+                    if (skipped_[i] >= MaxSkips)
+                    {
+                        break;
+                    }
+                }
+            }
+
+            for (std::size_t i = 0; i < Lanes; ++i)
+            {
+                skipped_[i] = i == selected || lanes_[i].empty() ? 0 : skipped_[i] + 1;
+            }
+
+            value = std::move(lanes_[selected].front());
+            lanes_[selected].pop();
+            --size_;
+            return true;
+        }
+
+        std::size_t size() const { return size_; }
+        bool        empty() const { return size_ == 0; }
+
+    private:
+        std::array<std::queue<T>, Lanes> lanes_;
+        std::array<std::size_t, Lanes>   skipped_{}; // receptions since a non-empty lane was last served
+        std::size_t                      size_{0};
+    };
+
+    // Queue that keeps only the latest message per key, Key()(message) returns the key of a message. A message whose key
+    // is already queued replaces the queued message at its position, so the queue never holds more messages than there
+    // are keys. Like locked_queue, it is protected by the mutex of the message type.
+    template <typename T, typename Key>
+    class conflating_queue
+    {
+    public:
+        static constexpr bool lock_free  = false;
+        static constexpr bool conflating = true;
+
+        bool try_push(T& value) // moves from value on success
+        {
+            auto key = Key()(message_of(value));
+            auto it  = latest_.find(key);
+            if (it != latest_.end())
+            {
+                it->second = std::move(value);
+                return true;
+            }
+
+            latest_.emplace(key, std::move(value));
+            order_.push(std::move(key));
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            if (order_.empty())
+            {
+                return false;
+            }
+
+            auto it = latest_.find(order_.front());
+            value   = std::move(it->second);
+            latest_.erase(it);
+            order_.pop();
+            return true;
+        }
+
+        std::size_t size() const { return order_.size(); }
+        bool        empty() const { return order_.empty(); }
+
+    private:
+        using key_type = std::decay_t<decltype(Key()(message_of(std::declval<const T&>())))>;
+
+        std::queue<key_type>            order_; // keys in the order their first message was sent
+        std::unordered_map<key_type, T> latest_;
+    };
+
+    // Ring whose messages are received by every subscriber instead of a single consumer, like a disruptor. A message is
+    // stored once and each subscriber has a cursor of its own (the sequence number of its next message), so a message
+    // is kept until the slowest subscriber has received it and the ring is full as soon as it lags Capacity messages
+    // behind. A subscriber starts with the messages that are sent after it subscribed, messages that are sent while there
+    // is no subscriber are discarded. try_pop receives the next message of the subscriber that the calling thread is
+    // bound to. Like locked_queue, it is protected by the mutex of the message type.
+    template <typename T, std::size_t Capacity>
+    class broadcast_ring
+    {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity of broadcast_ring must be a power of 2");
+        static_assert(std::is_copy_constructible<T>::value, "broadcast messages must be copyable, e.g. stored as std::shared_ptr");
+
+    public:
+        using subscriber = typename std::list<std::size_t>::iterator;
+
+        static constexpr bool        lock_free = false;
+        static constexpr bool        broadcast = true;
+        static constexpr std::size_t capacity  = Capacity;
+
+        // subscriber that try_pop receives for on the calling thread
+        struct binding
+        {
+            const broadcast_ring* ring{nullptr};
+            subscriber            cursor{};
+        };
+
+        broadcast_ring()
+            : slots_(new T[Capacity])
+        {
+        }
+
+        broadcast_ring(const broadcast_ring&)            = delete;
+        broadcast_ring& operator=(const broadcast_ring&) = delete;
+
+        bool try_push(T& value) // moves from value on success
+        {
+            if (head_ - tail_ == Capacity)
+            {
+                return false;
+            }
+
+            if (cursors_.empty())
+            {
+                T discarded(std::move(value)); // nobody would ever receive it
+                tail_ = ++head_;
+                return true;
+            }
+
+            slots_[head_ & (Capacity - 1)] = std::move(value);
+            ++head_;
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            const binding& bound = current_binding();
+            if (bound.ring != this || *bound.cursor == head_)
+            {
+                return false;
+            }
+
+            std::size_t& cursor = *bound.cursor;
+            value               = slots_[cursor & (Capacity - 1)];
+            if (cursor++ == tail_)
+            {
+                release();
+            }
+            return true;
+        }
+
+        // removes the oldest message for all subscribers, e.g. to make space for a newer one
+        bool try_discard(T& value)
+        {
+            if (head_ == tail_)
+            {
+                return false;
+            }
+
+            value = std::move(slots_[tail_ & (Capacity - 1)]);
+            ++tail_;
+            for (auto& cursor : cursors_)
+            {
+                cursor = std::max(cursor, tail_);
+            }
+            return true;
+        }
+
+        // number of messages that the slowest subscriber has not received yet
+        std::size_t size() const { return head_ - tail_; }
+        bool        empty() const { return head_ == tail_; }
+        bool        empty(subscriber s) const { return *s == head_; }
+
+        subscriber subscribe() { return cursors_.insert(cursors_.end(), head_); }
+
+        void unsubscribe(subscriber s)
+        {
+            const bool slowest = *s == tail_;
+            cursors_.erase(s);
+            if (slowest)
+            {
+                release();
+            }
+        }
+
+        // binds the calling thread to s and returns the previous binding, so it can be restored with restore_binding
+        binding bind_consumer(subscriber s)
+        {
+            binding previous  = current_binding();
+            current_binding() = {this, s};
+            return previous;
+        }
+
+        static void restore_binding(const binding& previous) { current_binding() = previous; }
+
+    private:
+        static binding& current_binding()
+        {
+            thread_local binding bound;
+            return bound;
+        }
+
+        // frees the messages that all subscribers have received
+        void release()
+        {
+            std::size_t slowest = head_;
+            for (const auto cursor : cursors_)
+            {
+                slowest = std::min(slowest, cursor);
+            }
+            for (; tail_ != slowest; ++tail_)
+            {
+                slots_[tail_ & (Capacity - 1)] = T();
+            }
+        }
+
+        std::unique_ptr<T[]>   slots_;
+        std::list<std::size_t> cursors_; // one per subscriber
+        std::size_t            head_{0}; // sequence number of the next message
+        std::size_t            tail_{0}; // sequence number of the oldest message that is kept
+    };
+
+#ifdef CLIME_HAS_SHARED_MEMORY
+    // Removes a shared memory segment (see shared_memory_ring), e.g. before the processes that use it are started again.
+    // Processes that have mapped it continue to use their mapping.
+    inline void remove_shared_memory(const char* name)
+    {
+        ::shm_unlink(name);
+    }
+
+    // Like mpmc_ring, but in the shared memory segment Name::name (e.g. "/my_app_ticks"), so that producers and consumers
+    // may run in different processes on the same host. The first process creates the segment and the messages in it
+    // survive the process that sent them until they are received. Messages are copied into and out of their slot, so
+    // they need to be trivially copyable. Other processes cannot notify the waiters of a message_manager, so waiting
+    // consumers and producers block on futexes in the segment instead.
+    template <typename T, std::size_t Capacity, typename Name>
+    class shared_memory_ring
+    {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity of shared_memory_ring must be a power of 2");
+        static_assert(std::is_trivially_copyable<T>::value, "messages in shared memory must be trivially copyable, e.g. stored with clime::inline_storage");
+        static_assert(std::atomic<std::size_t>::is_always_lock_free && sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t),
+                      "shared memory needs lock-free atomics");
+
+    public:
+        static constexpr bool        lock_free     = true;
+        static constexpr bool        shared_memory = true;
+        static constexpr std::size_t capacity      = Capacity;
+
+        shared_memory_ring()
+        {
+            int        fd      = ::shm_open(Name::name, O_RDWR | O_CREAT | O_EXCL, 0600);
+            const bool creator = fd >= 0;
+            if (!creator && errno == EEXIST)
+            {
+                fd = ::shm_open(Name::name, O_RDWR, 0600);
+            }
+            if (fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "shm_open");
+            }
+
+            auto is_sized = [fd]
+            {
+                struct stat status{};
+                return ::fstat(fd, &status) == 0 && status.st_size >= static_cast<off_t>(sizeof(segment));
+            };
+            if (creator ? ::ftruncate(fd, sizeof(segment)) != 0 : !wait_until(is_sized))
+            {
+                const int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "shared memory segment has not been created");
+            }
+
+            void*     memory = ::mmap(nullptr, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            const int error  = errno;
+            ::close(fd);
+            if (memory == MAP_FAILED)
+            {
+                throw std::system_error(error, std::generic_category(), "mmap");
+            }
+            segment_ = static_cast<segment*>(memory);
+
+            if (creator)
+            {
+                new (memory) segment();
+                for (std::size_t i = 0; i < Capacity; ++i)
+                {
+                    segment_->slots[i].sequence.store(i, std::memory_order_relaxed);
+                }
+                segment_->ready.store(layout(), std::memory_order_release);
+            }
+            else if (!wait_until([&]
+                                 { return segment_->ready.load(std::memory_order_acquire) != 0; }) ||
+                     segment_->ready.load(std::memory_order_acquire) != layout())
+            {
+                ::munmap(segment_, sizeof(segment));
+                throw std::system_error(EINVAL, std::generic_category(), "shared memory segment has another message type or capacity");
+            }
+        }
+
+        shared_memory_ring(const shared_memory_ring&)            = delete;
+        shared_memory_ring& operator=(const shared_memory_ring&) = delete;
+
+        ~shared_memory_ring()
+        {
+            ::munmap(segment_, sizeof(segment));
+        }
+
+        bool try_push(T& value)
+        {
+            std::size_t pos = segment_->enqueue_pos.load(std::memory_order_relaxed);
+            slot*       s;
+
+            for (;;)
+            {
+                s                        = &segment_->slots[pos & (Capacity - 1)];
+                const std::size_t   seq  = s->sequence.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+
+                if (diff == 0)
+                {
+                    if (segment_->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // full
+                }
+                else
+                {
+                    pos = segment_->enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+
+            std::memcpy(s->storage, &value, sizeof(T));
+            s->sequence.store(pos + 1, std::memory_order_release);
+            notify(segment_->pushed, segment_->waiting_consumers);
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            std::size_t pos = segment_->dequeue_pos.load(std::memory_order_relaxed);
+            slot*       s;
+
+            for (;;)
+            {
+                s                        = &segment_->slots[pos & (Capacity - 1)];
+                const std::size_t   seq  = s->sequence.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (segment_->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // empty
+                }
+                else
+                {
+                    pos = segment_->dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+
+            std::memcpy(&value, s->storage, sizeof(T));
+            s->sequence.store(pos + Capacity, std::memory_order_release);
+            notify(segment_->popped, segment_->waiting_producers);
+            return true;
+        }
+
+        std::size_t size() const
+        {
+            const std::size_t dequeue_pos = segment_->dequeue_pos.load(std::memory_order_acquire);
+            const std::size_t enqueue_pos = segment_->enqueue_pos.load(std::memory_order_acquire);
+            return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+        }
+
+        bool empty() const { return size() == 0; }
+
+        // Counts pushes (for consumers) or pops (for producers). Read it before the last attempt to push or pop and
+        // pass it to wait, so that no change is missed.
+        std::uint32_t epoch(bool consumer) const
+        {
+            return (consumer ? segment_->pushed : segment_->popped).load(std::memory_order_seq_cst);
+        }
+
+        // blocks until the epoch has changed (or spuriously), but not longer than until deadline
+        void wait(bool consumer, std::uint32_t epoch, std::chrono::steady_clock::time_point deadline)
+        {
+            auto& word    = consumer ? segment_->pushed : segment_->popped;
+            auto& waiting = consumer ? segment_->waiting_consumers : segment_->waiting_producers;
+
+            // a message that arrives within a few microseconds is received without any system call
+            for (int i = 0; i < 1000; ++i)
+            {
+                if (word.load(std::memory_order_acquire) != epoch)
+                {
+                    return;
+                }
+            }
+
+            timespec  timeout{};
+            timespec* relative = nullptr;
+            if (deadline != std::chrono::steady_clock::time_point::max())
+            {
+                const auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+                if (remaining.count() <= 0)
+                {
+                    return;
+                }
+                timeout.tv_sec  = static_cast<time_t>(remaining.count() / 1000000000);
+                timeout.tv_nsec = static_cast<long>(remaining.count() % 1000000000);
+                relative        = &timeout;
+            }
+
+            waiting.fetch_add(1, std::memory_order_seq_cst);
+            ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, epoch, relative, nullptr, 0);
+            waiting.fetch_sub(1, std::memory_order_seq_cst);
+        }
+
+        // wakes all waiters of this and other processes, e.g. because the message_manager is disposed
+        void interrupt()
+        {
+            for (auto* word : {&segment_->pushed, &segment_->popped})
+            {
+                word->fetch_add(1, std::memory_order_seq_cst);
+                ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+            }
+        }
+
+    private:
+        struct slot
+        {
+            std::atomic<std::size_t> sequence;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+
+        struct segment
+        {
+            std::atomic<std::uint32_t>                          ready{0}; // layout() as soon as the creator has initialized the segment
+            alignas(cache_line_size) std::atomic<std::size_t>   enqueue_pos{0};
+            alignas(cache_line_size) std::atomic<std::size_t>   dequeue_pos{0};
+            alignas(cache_line_size) std::atomic<std::uint32_t> pushed{0};
+            std::atomic<std::uint32_t>                          waiting_consumers{0};
+            alignas(cache_line_size) std::atomic<std::uint32_t> popped{0};
+            std::atomic<std::uint32_t>                          waiting_producers{0};
+            alignas(cache_line_size) slot                       slots[Capacity];
+        };
+
+        // detects processes that use the same name for different message types
+        static constexpr std::uint32_t layout()
+        {
+            return static_cast<std::uint32_t>(sizeof(T) * 2654435761u ^ Capacity ^ 0x636c696d);
+        }
+
+        template <typename Predicate>
+        static bool wait_until(Predicate pred)
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                if (pred())
+                {
+                    return true;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return false;
+        }
+
+        static void notify(std::atomic<std::uint32_t>& epoch, const std::atomic<std::uint32_t>& waiting)
+        {
+            epoch.fetch_add(1, std::memory_order_seq_cst);
+            if (waiting.load(std::memory_order_seq_cst) != 0)
+            {
+                ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&epoch), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+            }
+        }
+
+        segment* segment_{nullptr};
+    };
+#endif
+
+#ifdef CLIME_HAS_JOURNAL
+    // first bytes of the file path.offset of a journaled_queue
+    struct journal_offsets
+    {
+        std::uint32_t layout{0}; // 0 until the file has been initialized
+        std::uint32_t reserved{0};
+        std::uint64_t segment_messages{0};
+        std::uint64_t consumed{0}; // all messages before this one have been acknowledged
+    };
+
+    // Removes the files of a journaled_queue, e.g. to start without the messages of a previous run. The queue must not
+    // be in use.
+    inline void remove_journal(const char* path)
+    {
+        const std::string offsets_path = std::string(path) + ".offset";
+        journal_offsets   offsets;
+        const int         fd = ::open(offsets_path.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            if (::pread(fd, &offsets, sizeof(offsets), 0) != static_cast<ssize_t>(sizeof(offsets)))
+            {
+                offsets = journal_offsets();
+            }
+            ::close(fd);
+        }
+
+        std::uint64_t segment = offsets.segment_messages != 0 ? offsets.consumed / offsets.segment_messages : 0;
+        while (::unlink((std::string(path) + "." + std::to_string(segment)).c_str()) == 0)
+        {
+            ++segment;
+        }
+        ::unlink((std::string(path) + ".dead").c_str());
+        ::unlink(offsets_path.c_str());
+    }
+
+    // Queue whose messages are appended to preallocated, memory-mapped segment files of SegmentMessages messages each,
+    // Name::path followed by "." and the number of the segment (e.g. "/var/lib/my_app/orders.0"). The offset of the
+    // first message that has not been acknowledged is kept in Name::path followed by ".offset". After a restart, the
+    // queue contains all messages that had not been acknowledged, so each message is received at least once. Messages
+    // are copied into the files, so they need to be trivially copyable. Every SyncEvery messages, the written part of the
+    // files is flushed to disk with msync. Without it (SyncEvery 0), the messages survive a crash of the process, but not
+    // of the operating system. Segments are deleted when all their messages have been acknowledged. A message whose
+    // handler has thrown is received again, up to MaxAttempts times in all. Then it is appended to the dead letters in
+    // Name::path followed by ".dead" and counts as acknowledged, so that it does not keep the later messages in the
+    // journal.
+    template <typename T, std::size_t SegmentMessages, typename Name, std::size_t SyncEvery, std::size_t MaxAttempts>
+    class journaled_queue
+    {
+        static_assert(SegmentMessages > 0, "a segment of a journaled_queue needs space for at least 1 message");
+        static_assert(MaxAttempts > 0, "a journaled message needs to be handled at least once");
+        static_assert(std::is_trivially_copyable<T>::value, "journaled messages must be trivially copyable, e.g. stored with clime::inline_storage");
+
+    public:
+        static constexpr bool lock_free = false;
+        static constexpr bool journaled = true;
+
+        journaled_queue()
+        {
+            offsets_ = static_cast<journal_offsets*>(map_file(std::string(Name::path) + ".offset", sizeof(journal_offsets), true));
+            if (offsets_->layout == 0)
+            {
+                offsets_->segment_messages = SegmentMessages;
+                offsets_->consumed         = 0;
+                offsets_->layout           = layout();
+            }
+            else if (offsets_->layout != layout() || offsets_->segment_messages != SegmentMessages)
+            {
+                ::munmap(offsets_, sizeof(journal_offsets));
+                throw std::system_error(EINVAL, std::generic_category(), "journal has another message type or segment size");
+            }
+
+            // replays the messages that were written completely after the last acknowledged one
+            committed_     = offsets_->consumed;
+            read_          = committed_;
+            write_         = committed_;
+            synced_        = committed_;
+            first_segment_ = committed_ / SegmentMessages;
+            while (map_segment(write_ / SegmentMessages, false) && is_valid(at(write_), write_))
+            {
+                ++write_;
+            }
+            synced_ = write_;
+        }
+
+        journaled_queue(const journaled_queue&)            = delete;
+        journaled_queue& operator=(const journaled_queue&) = delete;
+
+        ~journaled_queue()
+        {
+            for (auto* s : segments_)
+            {
+                ::munmap(s, sizeof(segment));
+            }
+            ::munmap(offsets_, sizeof(journal_offsets));
+        }
+
+        // Throws std::system_error if a new segment file cannot be created, e.g. because the disk is full.
+        bool try_push(T& value)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            map_segment(write_ / SegmentMessages, true);
+
+            record& r = at(write_);
+            std::memcpy(r.payload, &value, sizeof(T));
+            r.checksum = checksum(r.payload, write_);
+            r.sequence = write_ + 1; // written last, so that a record is valid only if it has been written completely
+            ++write_;
+
+            if (SyncEvery != 0 && write_ - synced_ >= SyncEvery)
+            {
+                sync_written();
+            }
+            return true;
+        }
+
+        // The message stays in the journal until the receiving thread calls acknowledge. Messages to retry come first.
+        bool try_pop(T& value)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!retries_.empty())
+            {
+                const std::uint64_t sequence = retries_.front();
+                retries_.pop_front();
+                std::memcpy(&value, at(sequence).payload, sizeof(T));
+                received_[std::this_thread::get_id()].push_back(sequence);
+                return true;
+            }
+            if (read_ == write_)
+            {
+                return false;
+            }
+            received_[std::this_thread::get_id()].push_back(pop(value));
+            return true;
+        }
+
+        // removes the oldest message from the journal without waiting for an acknowledgement
+        bool try_discard(T& value)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!retries_.empty())
+            {
+                const std::uint64_t sequence = retries_.front();
+                retries_.pop_front();
+                std::memcpy(&value, at(sequence).payload, sizeof(T));
+                acknowledge(sequence);
+                return true;
+            }
+            if (read_ == write_)
+            {
+                return false;
+            }
+            acknowledge(pop(value));
+            return true;
+        }
+
+        // Acknowledges all messages that the calling thread has received from this queue and not acknowledged or
+        // abandoned yet.
+        void acknowledge()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto                        pending = received_.find(std::this_thread::get_id());
+            if (pending == received_.end())
+            {
+                return;
+            }
+            for (const auto sequence : pending->second)
+            {
+                acknowledge(sequence);
+            }
+            received_.erase(pending);
+        }
+
+        // Forgets the messages that the calling thread has received without acknowledging them, e.g. because the handlers
+        // are stopping. They stay in the journal and are received again after the next start, together with all messages
+        // after them.
+        void abandon()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            received_.erase(std::this_thread::get_id());
+        }
+
+        // Queues the messages that the calling thread has received without acknowledging them again, because their
+        // handler has thrown. Messages that have been received MaxAttempts times are moved to the dead letters instead.
+        // Returns the number of messages that are received again.
+        std::size_t retry()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto                        pending = received_.find(std::this_thread::get_id());
+            if (pending == received_.end())
+            {
+                return 0;
+            }
+
+            std::size_t retried = 0;
+            for (const auto sequence : pending->second)
+            {
+                if (sequence < committed_ || sequence >= read_ || acknowledged_[static_cast<std::size_t>(sequence - committed_)])
+                {
+                    continue;
+                }
+                if (++attempts_[sequence] < MaxAttempts)
+                {
+                    retries_.push_back(sequence);
+                    ++retried;
+                }
+                else
+                {
+                    write_dead_letter(sequence);
+                    acknowledge(sequence);
+                }
+            }
+            received_.erase(pending);
+            return retried;
+        }
+
+        // Returns the messages that were moved to the dead letters, also by earlier runs, in the order they were moved.
+        std::vector<T> dead_letters() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<T>              letters;
+            const int                   fd = ::open(dead_letter_path().c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                if (errno == ENOENT)
+                {
+                    return letters;
+                }
+                throw std::system_error(errno, std::generic_category(), "open " + dead_letter_path());
+            }
+
+            record r;
+            while (::read(fd, &r, sizeof(r)) == static_cast<ssize_t>(sizeof(r)))
+            {
+                if (r.sequence != 0 && is_valid(r, r.sequence - 1)) // skips a dead letter that has been torn by a crash
+                {
+                    letters.emplace_back();
+                    std::memcpy(&letters.back(), r.payload, sizeof(T));
+                }
+            }
+            ::close(fd);
+            return letters;
+        }
+
+        // flushes all messages and the offset of the acknowledged ones to disk
+        void sync()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sync_written();
+        }
+
+        std::size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return static_cast<std::size_t>(write_ - read_) + retries_.size();
+        }
+
+        bool empty() const { return size() == 0; }
+
+    private:
+        struct record
+        {
+            std::uint64_t sequence{0}; // position in the journal + 1, 0 if the record has not been written yet
+            std::uint32_t checksum{0};
+            std::uint32_t reserved{0};
+            alignas(T) unsigned char payload[sizeof(T)];
+        };
+
+        struct segment
+        {
+            std::uint32_t layout{0};
+            std::uint32_t reserved{0};
+            record        records[SegmentMessages];
+        };
+
+        // detects journals that were written for another message type
+        static constexpr std::uint32_t layout()
+        {
+            return static_cast<std::uint32_t>(sizeof(T) * 2654435761u ^ alignof(T) ^ 0x6a726e6c);
+        }
+
+        // FNV-1a of the message and its position, so that a record that has been torn by a crash is not replayed
+        static std::uint32_t checksum(const unsigned char* payload, std::uint64_t sequence)
+        {
+            std::uint32_t hash = 2166136261u;
+            for (std::size_t i = 0; i < sizeof(T); ++i)
+            {
+                hash = (hash ^ payload[i]) * 16777619u;
+            }
+            return (hash ^ static_cast<std::uint32_t>(sequence) ^ static_cast<std::uint32_t>(sequence >> 32)) * 16777619u;
+        }
+
+        static bool is_valid(const record& r, std::uint64_t sequence)
+        {
+            return r.sequence == sequence + 1 && r.checksum == checksum(r.payload, sequence);
+        }
+
+        // Returns nullptr if the file does not exist and create is false. A new file is filled with zeros.
+        static void* map_file(const std::string& path, std::size_t size, bool create)
+        {
+            const int fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+            if (fd < 0)
+            {
+                if (!create && errno == ENOENT)
+                {
+                    return nullptr;
+                }
+                throw std::system_error(errno, std::generic_category(), "open " + path);
+            }
+
+            // allocates the blocks on disk now, so that writing to the mapping cannot fail later
+            const int allocated = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+            if (allocated != 0)
+            {
+                ::close(fd);
+                throw std::system_error(allocated, std::generic_category(), "posix_fallocate " + path);
+            }
+
+            void*     memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            const int error  = errno;
+            ::close(fd);
+            if (memory == MAP_FAILED)
+            {
+                throw std::system_error(error, std::generic_category(), "mmap " + path);
+            }
+            return memory;
+        }
+
+        // Maps the segment with the given number if it is not mapped yet. Returns false if it does not exist and create
+        // is false. Segments are only mapped in ascending order.
+        bool map_segment(std::uint64_t index, bool create)
+        {
+            if (index < first_segment_ + segments_.size())
+            {
+                return true;
+            }
+
+            const std::string path = std::string(Name::path) + "." + std::to_string(index);
+            auto*             s    = static_cast<segment*>(map_file(path, sizeof(segment), create));
+            if (s == nullptr)
+            {
+                return false;
+            }
+            if (s->layout == 0)
+            {
+                s->layout = layout();
+            }
+            else if (s->layout != layout())
+            {
+                ::munmap(s, sizeof(segment));
+                throw std::system_error(EINVAL, std::generic_category(), "journal segment " + path + " has another message type");
+            }
+            segments_.push_back(s);
+            return true;
+        }
+
+        record& at(std::uint64_t sequence)
+        {
+            return segments_[static_cast<std::size_t>(sequence / SegmentMessages - first_segment_)]->records[sequence % SegmentMessages];
+        }
+
+        std::uint64_t pop(T& value) // called while holding mutex_
+        {
+            std::memcpy(&value, at(read_).payload, sizeof(T));
+            acknowledged_.push_back(false);
+            return read_++;
+        }
+
+        void acknowledge(std::uint64_t sequence) // called while holding mutex_
+        {
+            if (sequence < committed_ || sequence >= read_)
+            {
+                return;
+            }
+
+            acknowledged_[static_cast<std::size_t>(sequence - committed_)] = true;
+            attempts_.erase(sequence);
+            if (!acknowledged_.front())
+            {
+                return;
+            }
+            while (!acknowledged_.empty() && acknowledged_.front())
+            {
+                acknowledged_.pop_front();
+                ++committed_;
+            }
+            offsets_->consumed = committed_;
+
+            // the offset is written before the segment is removed, so that it never points into a removed segment
+            while (!segments_.empty() && (first_segment_ + 1) * SegmentMessages <= committed_)
+            {
+                ::munmap(segments_.front(), sizeof(segment));
+                ::unlink((std::string(Name::path) + "." + std::to_string(first_segment_)).c_str());
+                segments_.pop_front();
+                ++first_segment_;
+            }
+        }
+
+        static std::string dead_letter_path() { return std::string(Name::path) + ".dead"; }
+
+        // Appends the message to the dead letters and flushes them to disk, before the message is acknowledged.
+        void write_dead_letter(std::uint64_t sequence) // called while holding mutex_
+        {
+            const std::string path = dead_letter_path();
+            const int         fd   = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+            if (fd < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "open " + path);
+            }
+            const record& r       = at(sequence);
+            const bool    written = ::write(fd, &r, sizeof(r)) == static_cast<ssize_t>(sizeof(r)) && ::fdatasync(fd) == 0;
+            const int     error   = errno;
+            ::close(fd);
+            if (!written)
+            {
+                throw std::system_error(error, std::generic_category(), "write " + path);
+            }
+        }
+
+        void sync_written() // called while holding mutex_
+        {
+            static const std::uintptr_t page_size = static_cast<std::uintptr_t>(::sysconf(_SC_PAGESIZE));
+
+            for (std::uint64_t sequence = std::max(synced_, first_segment_ * SegmentMessages); sequence < write_;)
+            {
+                const std::uint64_t segment_end = (sequence / SegmentMessages + 1) * SegmentMessages;
+                const std::uint64_t end         = std::min(segment_end, write_);
+                const auto          first       = reinterpret_cast<std::uintptr_t>(&at(sequence)) & ~(page_size - 1);
+                const auto          last        = reinterpret_cast<std::uintptr_t>(&at(end - 1)) + sizeof(record);
+                ::msync(reinterpret_cast<void*>(first), last - first, MS_SYNC);
+                sequence = end;
+            }
+            ::msync(offsets_, sizeof(journal_offsets), MS_SYNC);
+            synced_ = write_;
+        }
+
+        mutable std::mutex                                                 mutex_;
+        journal_offsets*                                                   offsets_{nullptr};
+        std::deque<segment*>                                               segments_;     // from first_segment_ on
+        std::deque<bool>                                                   acknowledged_; // of the received messages from committed_ on
+        std::unordered_map<std::thread::id, std::vector<std::uint64_t>>    received_;     // received, but not acknowledged, per thread
+        std::unordered_map<std::uint64_t, std::size_t>                     attempts_;     // failed attempts of the messages to retry
+        std::deque<std::uint64_t>                                          retries_;      // messages to receive again before read_
+        std::uint64_t                                                      first_segment_{0};
+        std::uint64_t                                                      committed_{0}; // offset of the first message that has not been acknowledged
+        std::uint64_t                                                      read_{0};
+        std::uint64_t                                                      write_{0};
+        std::uint64_t                                                      synced_{0};
+    };
+#endif
+
+    struct locked_queue_policy
+    {
+        template <typename T>
+        using queue = locked_queue<T>;
+    };
+
+    template <std::size_t Capacity>
+    struct spsc_ring_policy
+    {
+        template <typename T>
+        using queue = spsc_ring<T, Capacity>;
+    };
+
+    template <std::size_t Capacity>
+    struct mpmc_ring_policy
+    {
+        template <typename T>
+        using queue = mpmc_ring<T, Capacity>;
+    };
+
+    // Key is a default constructible function object that returns a hashable key of a message, e.g.
+    // struct session_key { int operator()(const my_message& msg) const { return msg.session_id; } };
+    template <std::size_t Shards, typename Key = void>
+    struct sharded_queue_policy
+    {
+        template <typename T>
+        using queue = sharded_queue<T, Shards, Key>;
+    };
+
+    // Like sharded_queue_policy, but without stealing: messages with the same key are always received by the same handler
+    // in the order they were sent, while messages with different keys are handled in parallel. The shards are
+    // distributed to the handlers of the message type, so add_handler throws std::length_error for more than Shards.
+    template <std::size_t Shards, typename Key>
+    struct keyed_queue_policy
+    {
+        template <typename T>
+        using queue = sharded_queue<T, Shards, Key, false>;
+    };
+
+    // Key is a default constructible function object that returns a hashable key of a message, e.g.
+    // struct sensor_key { int operator()(const sensor_state& msg) const { return msg.sensor_id; } };
+    template <typename Key>
+    struct conflating_queue_policy
+    {
+        template <typename T>
+        using queue = conflating_queue<T, Key>;
+    };
+
+    // Every message is received by all handlers and subscriptions of the message type (see broadcast_ring), up to
+    // Capacity messages are kept for the slowest of them.
+    template <std::size_t Capacity>
+    struct broadcast_queue_policy
+    {
+        template <typename T>
+        using queue = broadcast_ring<T, Capacity>;
+    };
+
+#ifdef CLIME_HAS_SHARED_MEMORY
+    // Name is a type with the name of the shared memory segment, e.g.
+    // struct tick_segment { static constexpr const char* name = "/my_app_ticks"; };
+    // Messages must be trivially copyable and use clime::inline_storage.
+    template <std::size_t Capacity, typename Name>
+    struct shared_memory_queue_policy
+    {
+        template <typename T>
+        using queue = shared_memory_ring<T, Capacity, Name>;
+    };
+#endif
+
+#ifdef CLIME_HAS_JOURNAL
+    // Name is a type with the path of the journal files, e.g.
+    // struct order_journal { static constexpr const char* path = "/var/lib/my_app/orders"; };
+    // Messages must be trivially copyable and use clime::inline_storage. A message whose handler throws is handled up to
+    // MaxAttempts times before it is moved to the dead letters (see message_manager::dead_letters).
+    template <std::size_t SegmentMessages, typename Name, std::size_t SyncEvery = 0, std::size_t MaxAttempts = 3>
+    struct journaled_queue_policy
+    {
+        template <typename T>
+        using queue = journaled_queue<T, SegmentMessages, Name, SyncEvery, MaxAttempts>;
+    };
+#endif
+
+    // Priority is a default constructible function object that returns the lane of a message, e.g.
+    // struct urgency { int operator()(const my_message& msg) const { return msg.is_cancel ? 0 : 1; } };
+    template <std::size_t Lanes, typename Priority, std::size_t MaxSkips = 64>
+    struct priority_queue_policy
+    {
+        template <typename T>
+        using queue = priority_lanes<T, Lanes, Priority, MaxSkips>;
+    };
+
+    // true for queues whose messages may only be received by the consumer bound to their shard
+    template <typename Queue, typename = void>
+    struct is_affine_queue : std::false_type
+    {
+    };
+
+    template <typename Queue>
+    struct is_affine_queue<Queue, std::enable_if_t<Queue::affine>> : std::true_type
+    {
+    };
+
+    // true for queues that are shared with other processes, so their waiters cannot be notified within the process
+    template <typename Queue, typename = void>
+    struct is_shared_memory_queue : std::false_type
+    {
+    };
+
+    template <typename Queue>
+    struct is_shared_memory_queue<Queue, std::enable_if_t<Queue::shared_memory>> : std::true_type
+    {
+    };
+
+    // true for queues that only their consumer may pop from, so senders cannot drop their oldest messages
+    template <typename Queue, typename = void>
+    struct is_single_consumer_queue : std::false_type
+    {
+    };
+
+    template <typename Queue>
+    struct is_single_consumer_queue<Queue, std::enable_if_t<Queue::single_consumer>> : std::true_type
+    {
+    };
+
+    // true for queues that replace a queued message instead of adding one, so try_push does not always grow them
+    template <typename Queue, typename = void>
+    struct is_conflating_queue : std::false_type
+    {
+    };
+
+    template <typename Queue>
+    struct is_conflating_queue<Queue, std::enable_if_t<Queue::conflating>> : std::true_type
+    {
+    };
+
+    // true for queues that persist their messages until they are acknowledged
+    template <typename Queue, typename = void>
+    struct is_journaled_queue : std::false_type
+    {
+    };
+
+    template <typename Queue>
+    struct is_journaled_queue<Queue, std::enable_if_t<Queue::journaled>> : std::true_type
+    {
+    };
+
+    // true for queues whose messages are received by every subscriber, subscriber is the cursor of one of them
+    template <typename Queue, typename = void>
+    struct is_broadcast_queue : std::false_type
+    {
+        using subscriber = std::size_t; // unused
+    };
+
+    template <typename Queue>
+    struct is_broadcast_queue<Queue, std::enable_if_t<Queue::broadcast>> : std::true_type
+    {
+        using subscriber = typename Queue::subscriber;
+    };
+
+    // Specialize this trait to select the queue of a message type, e.g.
+    // template <> struct clime::queue_policy<my_message> : clime::spsc_ring_policy<1024> {};
+    template <typename MessageType>
+    struct queue_policy : locked_queue_policy
+    {
+    };
+
+    // How a receiver that waits for a message checks the queue before it parks, i.e. sleeps until a producer wakes it.
+    // Spinning saves the time of sleeping and waking up (several microseconds) at the cost of CPU time.
+    enum class wait_strategy
+    {
+        park,       // sleep at once (default)
+        busy_spin,  // check the queue in a tight loop and never sleep, for cores that do nothing else
+        spin_pause, // check the queue spin_count times with a CPU pause instruction in between, then park
+        yield,      // check the queue spin_count times and give up the time slice in between, then park
+        adaptive    // like spin_pause, but spin up to spin_count times while messages arrive often, less when it is quiet
+    };
+
+    struct park_wait_policy
+    {
+        static constexpr wait_strategy strategy   = wait_strategy::park;
+        static constexpr unsigned int  spin_count = 0;
+    };
+
+    template <wait_strategy Strategy, unsigned int SpinCount = 1024>
+    struct spin_wait_policy
+    {
+        static constexpr wait_strategy strategy   = Strategy;
+        static constexpr unsigned int  spin_count = SpinCount;
+    };
+
+    // Specialize this trait to select how receivers of a type wait, e.g.
+    // template <> struct clime::wait_policy<my_message> : clime::spin_wait_policy<clime::wait_strategy::adaptive> {};
+    template <typename MessageType>
+    struct wait_policy : park_wait_policy
+    {
+    };
+
+    // Features of a message type that can be removed at compile time, see feature_policy.
+    struct no_logging // set_logger and set_async_logger are not available, so sending and receiving do not check for loggers
+    {
+    };
+
+    struct no_backpressure // max_queued_messages and the capacity of set_capacity are ignored, so the queue length is never checked
+    {
+    };
+
+    template <typename... Removed>
+    struct features
+    {
+        template <typename Feature>
+        static constexpr bool removed = std::disjunction<std::is_same<Feature, Removed>...>::value;
+    };
+
+    // Specialize this trait to remove features that a message type does not use, e.g.
+    // template <> struct clime::feature_policy<my_message> : clime::features<clime::no_logging, clime::no_backpressure> {};
+    template <typename MessageType>
+    struct feature_policy : features<>
+    {
+    };
+
+    // Messages are stored as std::shared_ptr, so they are never copied (default).
+    struct shared_storage
+    {
+        template <typename T>
+        using element = std::shared_ptr<T>; // stored in the queue, passed to handlers and loggers
+
+        template <typename T>
+        using pointer = std::shared_ptr<T>; // returned by receive_message, empty if there was no message
+
+        template <typename T>
+        static std::shared_ptr<T> store(std::shared_ptr<T> msg) { return msg; }
+
+        template <typename T>
+        static std::shared_ptr<T> store(std::unique_ptr<T> msg) { return msg; }
+
+        template <typename T>
+        static std::shared_ptr<T> store_value(T&& msg) { return std::make_shared<T>(std::move(msg)); }
+
+        template <typename T>
+        static std::shared_ptr<T> to_pointer(std::shared_ptr<T>&& element) { return std::move(element); }
+    };
+
+    // Messages are stored as std::unique_ptr, so they are moved from the sender to exactly one receiver without atomic
+    // reference counting.
+    struct unique_storage
+    {
+        template <typename T>
+        using element = std::unique_ptr<T>;
+
+        template <typename T>
+        using pointer = std::unique_ptr<T>;
+
+        template <typename T>
+        static std::unique_ptr<T> store(std::shared_ptr<T> msg) = delete; // a std::shared_ptr cannot give up ownership
+
+        template <typename T>
+        static std::unique_ptr<T> store(std::unique_ptr<T> msg) { return msg; }
+
+        template <typename T>
+        static std::unique_ptr<T> store_value(T&& msg) { return std::unique_ptr<T>(new T(std::move(msg))); }
+
+        template <typename T>
+        static std::unique_ptr<T> to_pointer(std::unique_ptr<T>&& element) { return std::move(element); }
+    };
+
+    // Messages are stored by value in the queue, which avoids any heap allocation for small, trivially copyable
+    // messages. receive_message returns a std::optional, handlers and loggers get the message itself.
+    struct inline_storage
+    {
+        template <typename T>
+        using element = T;
+
+        template <typename T>
+        using pointer = std::optional<T>;
+
+        template <typename T>
+        static T store(std::shared_ptr<T> msg) { return *msg; }
+
+        template <typename T>
+        static T store(std::unique_ptr<T> msg) { return std::move(*msg); }
+
+        template <typename T>
+        static T store_value(T&& msg) { return std::move(msg); }
+
+        template <typename T>
+        static std::optional<T> to_pointer(T&& element) { return std::optional<T>(std::move(element)); }
+    };
+
+    // Specialize this trait to select how messages of a type are stored, e.g.
+    // template <> struct clime::storage_policy<my_message> : clime::inline_storage {};
+    template <typename MessageType>
+    struct storage_policy : shared_storage
+    {
+    };
+
+    // Combines several lambdas to one overload set for one_of::visit, e.g. overloaded{[](a msg) {}, [](b msg) {}}.
+    template <typename... Functions>
+    struct overloaded : Functions...
+    {
+        using Functions::operator()...;
+    };
+
+    template <typename... Functions>
+    overloaded(Functions...) -> overloaded<Functions...>;
+
+    // Message that holds one of MessageTypes by value. ordered_message_manager passes all its message types in one queue
+    // of one_of, so their order is kept.
+    template <typename... MessageTypes>
+    class one_of
+    {
+        template <typename MessageType>
+        using enable_if_message_type = std::enable_if_t<std::disjunction<std::is_same<MessageType, MessageTypes>...>::value>;
+
+    public:
+        one_of() = default; // empty, only used for queue slots that have not received a message yet
+
+        template <typename MessageType, typename = enable_if_message_type<MessageType>>
+        one_of(MessageType msg)
+            : value_(std::in_place_type<MessageType>, std::move(msg))
+        {
+        }
+
+        bool empty() const { return value_.index() == 0; }
+
+        // position of the held type in MessageTypes
+        std::size_t type_index() const { return value_.index() - 1; }
+
+        template <typename MessageType, typename = enable_if_message_type<MessageType>>
+        bool holds() const { return std::holds_alternative<MessageType>(value_); }
+
+        template <typename MessageType, typename = enable_if_message_type<MessageType>>
+        MessageType* get_if() { return std::get_if<MessageType>(&value_); }
+
+        template <typename MessageType, typename = enable_if_message_type<MessageType>>
+        const MessageType* get_if() const { return std::get_if<MessageType>(&value_); }
+
+        // Calls visitor with the held message through a table of functions that is indexed by type_index, an rvalue
+        // one_of passes the message as rvalue. All overloads must have the same return type. Throws
+        // std::bad_variant_access if the one_of is empty.
+        template <typename Visitor>
+        decltype(auto) visit(Visitor&& visitor) &
+        {
+            return dispatch(value_, std::forward<Visitor>(visitor), std::index_sequence_for<MessageTypes...>());
+        }
+
+        template <typename Visitor>
+        decltype(auto) visit(Visitor&& visitor) const&
+        {
+            return dispatch(value_, std::forward<Visitor>(visitor), std::index_sequence_for<MessageTypes...>());
+        }
+
+        template <typename Visitor>
+        decltype(auto) visit(Visitor&& visitor) &&
+        {
+            return dispatch(std::move(value_), std::forward<Visitor>(visitor), std::index_sequence_for<MessageTypes...>());
+        }
+
+    private:
+        using variant_type = std::variant<std::monostate, MessageTypes...>;
+
+        template <typename Variant, typename Visitor>
+        using visit_result = decltype(std::declval<Visitor>()(std::get<1>(std::declval<Variant>())));
+
+        template <std::size_t I, typename Variant, typename Visitor>
+        static visit_result<Variant, Visitor> invoke(Variant&& value, Visitor&& visitor)
+        {
+            using alternative = decltype(std::get<I + 1>(std::declval<Variant>())); // keeps the value category of Variant
+            return std::forward<Visitor>(visitor)(static_cast<alternative>(*std::get_if<I + 1>(&value)));
+        }
+
+        template <typename Variant, typename Visitor, std::size_t... Is>
+        static visit_result<Variant, Visitor> dispatch(Variant&& value, Visitor&& visitor, std::index_sequence<Is...>)
+        {
+            using function                    = visit_result<Variant, Visitor> (*)(Variant&&, Visitor&&);
+            static constexpr function table[] = {&invoke<Is, Variant, Visitor>...};
+            if (value.index() == 0 || value.valueless_by_exception())
+            {
+                throw std::bad_variant_access();
+            }
+            return table[value.index() - 1](std::forward<Variant>(value), std::forward<Visitor>(visitor));
+        }
+
+        variant_type value_;
+    };
+
+    // one_of is a small value that is queued without an allocation of its own
+    template <typename... MessageTypes>
+    struct storage_policy<one_of<MessageTypes...>> : inline_storage
+    {
+    };
+
+    // Thread safe free lists of memory blocks, one per size class of 16 << i bytes up to max_block_size. Larger blocks and
+    // blocks that need a stricter alignment than std::max_align_t are taken from the heap and returned to it directly.
+    // The other blocks are returned to the heap when the pool is destroyed.
+    class block_pool
+    {
+    public:
+        static constexpr std::size_t size_classes   = 8;
+        static constexpr std::size_t min_block_size = 16;
+        static constexpr std::size_t max_block_size = min_block_size << (size_classes - 1);
+
+        block_pool() = default;
+
+        block_pool(const block_pool&)            = delete;
+        block_pool& operator=(const block_pool&) = delete;
+
+        ~block_pool()
+        {
+            for (auto* free : free_)
+            {
+                while (free != nullptr)
+                {
+                    free_block* next = free->next;
+                    ::operator delete(free);
+                    free = next;
+                }
+            }
+        }
+
+        void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+        {
+            if (alignment > alignof(std::max_align_t))
+            {
+                return ::operator new(size, std::align_val_t(alignment));
+            }
+
+            const std::size_t index = size_class(size);
+            if (index == size_classes)
+            {
+                return ::operator new(size);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (free_block* block = free_[index])
+                {
+                    free_[index] = block->next;
+                    --available_;
+                    return block;
+                }
+            }
+            return ::operator new(min_block_size << index);
+        }
+
+        void deallocate(void* p, std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+        {
+            if (alignment > alignof(std::max_align_t))
+            {
+                ::operator delete(p, std::align_val_t(alignment));
+                return;
+            }
+
+            const std::size_t index = size_class(size);
+            if (index == size_classes)
+            {
+                ::operator delete(p);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_[index] = new (p) free_block{free_[index]};
+            ++available_;
+        }
+
+        // number of blocks in the free lists
+        std::size_t available() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return available_;
+        }
+
+    private:
+        struct free_block
+        {
+            free_block* next;
+        };
+
+        // the smallest size class whose blocks have at least size bytes, size_classes if there is none
+        static std::size_t size_class(std::size_t size)
+        {
+            std::size_t index = 0;
+            while (index < size_classes && (min_block_size << index) < size)
+            {
+                ++index;
+            }
+            return index;
+        }
+
+        mutable std::mutex                      mutex_;
+        std::array<free_block*, size_classes> free_{};
+        std::size_t                             available_{0};
+    };
+
+    // Allocator that takes its memory from a block_pool, e.g. for std::allocate_shared. The pool lives as long as any
+    // allocator (and therefore any object allocated with std::allocate_shared) refers to it.
+    template <typename T>
+    class pool_allocator
+    {
+    public:
+        using value_type = T;
+
+        explicit pool_allocator(std::shared_ptr<block_pool> pool)
+            : pool_(std::move(pool))
+        {
+        }
+
+        template <typename U>
+        pool_allocator(const pool_allocator<U>& other) // NOLINT(google-explicit-constructor)
+            : pool_(other.pool_)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(pool_->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T* p, std::size_t n)
+        {
+            pool_->deallocate(p, n * sizeof(T), alignof(T));
+        }
+
+        template <typename U>
+        bool operator==(const pool_allocator<U>& other) const { return pool_ == other.pool_; }
+
+        template <typename U>
+        bool operator!=(const pool_allocator<U>& other) const { return pool_ != other.pool_; }
+
+    private:
+        template <typename U>
+        friend class pool_allocator;
+
+        std::shared_ptr<block_pool> pool_;
+    };
+
+    // Runs functions at given points in time. All functions run in a single thread, which is started when the first
+    // function is scheduled.
+    class timer
+    {
+    private:
+        struct state;
+
+    public:
+        using clock = std::chrono::steady_clock;
+
+        class handle
+        {
+        public:
+            handle() = default;
+
+            // Returns true if the function was removed before it was run, so it will never run.
+            bool cancel()
+            {
+                auto s = state_.lock();
+                if (!s)
+                {
+                    return false;
+                }
+
+                bool cancelled = false;
+                {
+                    std::lock_guard<std::mutex> lock(s->mutex);
+                    cancelled = s->entries.erase(key_) != 0;
+                }
+                if (cancelled && s->on_removed)
+                {
+                    s->on_removed();
+                }
+                return cancelled;
+            }
+
+        private:
+            friend class timer;
+
+            handle(std::weak_ptr<state> s, clock::time_point time, std::uint64_t id)
+                : state_(std::move(s))
+                , key_(time, id)
+            {
+            }
+
+            std::weak_ptr<state>                         state_;
+            std::pair<clock::time_point, std::uint64_t> key_;
+        };
+
+        timer() = default;
+
+        // on_removed is called whenever a function has run or was cancelled
+        explicit timer(std::function<void()> on_removed)
+        {
+            state_->on_removed = std::move(on_removed);
+        }
+
+        timer(const timer&)            = delete;
+        timer& operator=(const timer&) = delete;
+
+        ~timer()
+        {
+            stop();
+        }
+
+        handle schedule(clock::time_point time, std::function<void()> function)
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            if (!state_->running)
+            {
+                return {};
+            }
+
+            const std::uint64_t id    = state_->next_id++;
+            const bool          first = state_->entries.empty() || time < state_->entries.begin()->first.first;
+            state_->entries.emplace(std::make_pair(time, id), std::move(function));
+
+            if (!thread_.joinable())
+            {
+                thread_ = std::thread([this]
+                                      { run(); });
+            }
+            else if (first)
+            {
+                state_->cv.notify_one();
+            }
+
+            return handle(state_, time, id);
+        }
+
+        // the number of functions that have not run yet, including one that is running
+        std::size_t pending() const
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            return state_->entries.size() + (state_->busy ? 1 : 0);
+        }
+
+        // Discards all pending functions, waits until a currently running function has returned and returns the number
+        // of discarded functions. Must not be called by a scheduled function.
+        std::size_t stop()
+        {
+            std::size_t discarded = 0;
+            {
+                std::lock_guard<std::mutex> lock(state_->mutex);
+                state_->running = false;
+                discarded       = state_->entries.size();
+                state_->entries.clear();
+            }
+            state_->cv.notify_one();
+
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+            return discarded;
+        }
+
+    private:
+        struct state
+        {
+            std::mutex                                                                    mutex;
+            std::condition_variable                                                       cv;
+            std::map<std::pair<clock::time_point, std::uint64_t>, std::function<void()>> entries;
+            std::function<void()>                                                         on_removed;
+            std::uint64_t                                                                 next_id{0};
+            bool                                                                          running{true};
+            bool                                                                          busy{false}; // a function is running
+        };
+
+        std::shared_ptr<state> state_ = std::make_shared<state>();
+        std::thread            thread_;
+
+        void run()
+        {
+            set_thread_name("clime_timer");
+            std::unique_lock<std::mutex> lock(state_->mutex);
+
+            while (state_->running)
+            {
+                if (state_->entries.empty())
+                {
+                    state_->cv.wait(lock);
+                }
+                else if (clock::now() < state_->entries.begin()->first.first)
+                {
+                    const auto due = state_->entries.begin()->first.first; // the entry may be cancelled while waiting
+                    state_->cv.wait_until(lock, due);
+                }
+                else
+                {
+                    auto function = std::move(state_->entries.begin()->second);
+                    state_->entries.erase(state_->entries.begin());
+                    state_->busy = true;
+
+                    lock.unlock();
+                    function();
+                    lock.lock();
+                    state_->busy = false;
+                    if (state_->on_removed)
+                    {
+                        lock.unlock();
+                        state_->on_removed();
+                        lock.lock();
+                    }
+                }
+            }
+        }
+    };
+
+    // What an asynchronous logger is told about a message, see message_manager::set_async_logger.
+    struct log_record
+    {
+        std::size_t                 type_index{0}; // of the message type in the message_manager
+        timer::clock::time_point    time;
+        bool                        sending{false};
+        std::shared_ptr<const void> message;
+    };
+
+    // Passes log records to dispatch in a background thread, so that asynchronous loggers do not slow down sending and
+    // receiving messages. Records are written to a lock-free ring, and the thread is only woken if it sleeps because it
+    // has emptied the ring. If the ring is full, records are dropped and counted.
+    class log_writer
+    {
+    public:
+        static constexpr std::size_t capacity = 4096;
+
+        explicit log_writer(std::function<void(const log_record&)> dispatch)
+            : dispatch_(std::move(dispatch))
+        {
+        }
+
+        log_writer(const log_writer&)            = delete;
+        log_writer& operator=(const log_writer&) = delete;
+
+        ~log_writer()
+        {
+            stop();
+        }
+
+        // moves from record on success, the thread is started with the first record
+        bool push(log_record& record)
+        {
+            std::call_once(started_, [this]
+                           {
+                               ring_   = std::make_unique<mpmc_ring<log_record, capacity>>();
+                               thread_ = std::thread([this]
+                                                     { run(); });
+                               set_thread_name(thread_, "clime_logger"); }); // at most 15 characters on Linux
+
+            if (stopping_.load(std::memory_order_relaxed) || !ring_->try_push(record))
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // pairs with the fence in run, so that either the thread sees the record or this sees sleeping_
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleeping_.load(std::memory_order_relaxed))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    sleeping_.store(false, std::memory_order_relaxed);
+                }
+                cv_.notify_one();
+            }
+            return true;
+        }
+
+        // writes all pending records and ends the thread, later records are dropped
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            cv_.notify_one();
+
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+        }
+
+        std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+        void run()
+        {
+            for (;;)
+            {
+                write_pending();
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (stopping_)
+                {
+                    break;
+                }
+                sleeping_.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ring_->size() == 0)
+                {
+                    cv_.wait(lock, [this]
+                             { return !sleeping_.load(std::memory_order_relaxed) || stopping_.load(); });
+                }
+                sleeping_.store(false, std::memory_order_relaxed);
+            }
+            write_pending();
+        }
+
+        void write_pending()
+        {
+            log_record record;
+            while (ring_->try_pop(record))
+            {
+                try
+                {
+                    dispatch_(record);
+                }
+                catch (...)
+                {
+                    // a failing logger must not end the thread
+                }
+                record.message.reset();
+            }
+        }
+
+        std::function<void(const log_record&)>           dispatch_;
+        std::unique_ptr<mpmc_ring<log_record, capacity>> ring_;
+        std::once_flag                                   started_;
+        std::thread                                      thread_;
+        std::mutex                                       mutex_;
+        std::condition_variable                          cv_;
+        std::atomic<bool>                                stopping_{false};
+        std::atomic<bool>                                sleeping_{false}; // the thread waits for cv_
+        std::atomic<std::uint64_t>                       dropped_{0};
+    };
+
+    // Pool of worker threads that run tasks. Each worker has its own task queue, and idle workers steal tasks from the
+    // queues of other workers. Tasks submitted by a worker are put into its own queue.
+    class executor
+    {
+    public:
+        // options are applied to every worker thread, settings that fail are ignored
+        explicit executor(std::size_t thread_count = std::thread::hardware_concurrency(), const thread_options& options = {})
+        {
+            if (thread_count == 0)
+            {
+                thread_count = 1;
+            }
+
+            for (std::size_t i = 0; i < thread_count; ++i)
+            {
+                queues_.emplace_back(new task_queue);
+            }
+
+            for (std::size_t i = 0; i < thread_count; ++i)
+            {
+                threads_.emplace_back([this, i, options]
+                                      {
+                                          if (!options.empty())
+                                          {
+                                              static_cast<void>(apply_thread_options(options));
+                                          }
+                                          run(i); });
+            }
+        }
+
+        executor(const executor&)            = delete;
+        executor& operator=(const executor&) = delete;
+
+        // runs all pending tasks before the worker threads are stopped
+        ~executor()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                running_ = false;
+            }
+            cv_.notify_all();
+
+            for (auto& thread : threads_)
+            {
+                thread.join();
+            }
+        }
+
+        void submit(std::function<void()> task)
+        {
+            const std::size_t index = current_executor() == this
+                                        ? current_worker()
+                                        : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+            {
+                std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+                queues_[index]->tasks.push_back(std::move(task));
+            }
+
+            pending_.fetch_add(1);
+            if (sleeping_.load() != 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                }
+                cv_.notify_one();
+            }
+        }
+
+        std::size_t thread_count() const
+        {
+            return threads_.size();
+        }
+
+        // executor that is shared by all users that do not provide their own one
+        static executor& default_executor()
+        {
+            static executor instance;
+            return instance;
+        }
+
+    private:
+        struct alignas(cache_line_size) task_queue
+        {
+            std::mutex                        mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<task_queue>>          queues_;
+        std::vector<std::thread>                          threads_;
+        std::mutex                                        mutex_;
+        std::condition_variable                           cv_;
+        bool                                              running_{true};
+        alignas(cache_line_size) std::atomic<std::size_t> pending_{0}; // modified by every submit and task
+        std::atomic<std::size_t>                          sleeping_{0};
+        std::atomic<std::size_t>                          next_queue_{0};
+
+        static executor*& current_executor()
+        {
+            static thread_local executor* instance = nullptr;
+            return instance;
+        }
+
+        static std::size_t& current_worker()
+        {
+            static thread_local std::size_t index = 0;
+            return index;
+        }
+
+        bool take_task(std::size_t index, std::function<void()>& task)
+        {
+            // the own queue is served in FIFO order, other queues are robbed from the back
+            for (std::size_t i = 0; i < queues_.size(); ++i)
+            {
+                task_queue&                 queue = *queues_[(index + i) % queues_.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tasks.empty())
+                {
+                    if (i == 0)
+                    {
+                        task = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                    }
+                    else
+                    {
+                        task = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(std::size_t index)
+        {
+            current_executor() = this;
+            current_worker()   = index;
+            set_thread_name("clime_worker");
+
+            std::function<void()> task;
+            for (;;)
+            {
+                if (take_task(index, task))
+                {
+                    pending_.fetch_sub(1);
+                    try
+                    {
+                        task();
+                    }
+                    catch (...)
+                    {
+                        // tasks are expected to handle their exceptions, there is no one to report it to
+                    }
+                    task = nullptr;
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                sleeping_.fetch_add(1);
+                cv_.wait(lock, [&]
+                         { return pending_.load() != 0 || !running_; });
+                sleeping_.fetch_sub(1);
+
+                if (!running_ && pending_.load() == 0)
+                {
+                    return;
+                }
+            }
+        }
+    };
+
+    // What send_message does if the queue of a message type is full, see message_manager::set_capacity.
+    enum class overflow_policy
+    {
+        block,       // wait until there is space
+        drop_newest, // drop the message that was about to be sent
+        drop_oldest  // drop the oldest queued messages to make space (not for spsc_ring_policy, whose consumer is the only one that may pop)
+    };
+
+    // How message_manager::shutdown treats messages that have not been received yet.
+    enum class shutdown_mode
+    {
+        drain, // handlers receive the queued and delayed messages until there are none left or the deadline has passed
+        abort  // drop them immediately
+    };
+
+    // Histogram of durations with logarithmic buckets that are split into 8 linear sub-buckets each, so every recorded
+    // value is known with a relative error below 12.5% (like an HDR histogram with one significant digit).
+    struct latency_histogram
+    {
+        static constexpr std::size_t sub_buckets  = 8;
+        static constexpr std::size_t bucket_count = sub_buckets * 62;
+
+        std::array<std::uint64_t, bucket_count> counts{};
+        std::uint64_t                           count{0}; // number of recorded durations
+        std::chrono::nanoseconds                max{0};
+
+        static std::size_t bucket(std::uint64_t nanoseconds)
+        {
+            if (nanoseconds < sub_buckets)
+            {
+                return static_cast<std::size_t>(nanoseconds);
+            }
+
+            std::size_t highest_bit = 0;
+#if defined(__GNUC__) || defined(__clang__)
+            highest_bit = 63 - static_cast<std::size_t>(__builtin_clzll(nanoseconds));
+#else
+            for (auto v = nanoseconds; v > 1; v >>= 1)
+            {
+                ++highest_bit;
+            }
+#endif
+            return (highest_bit - 2) * sub_buckets + static_cast<std::size_t>((nanoseconds >> (highest_bit - 3)) & (sub_buckets - 1));
+        }
+
+        // smallest duration that falls into the given bucket
+        static std::uint64_t lower_bound(std::size_t bucket)
+        {
+            if (bucket < 2 * sub_buckets)
+            {
+                return bucket;
+            }
+
+            const std::size_t highest_bit = bucket / sub_buckets + 2;
+            return (std::uint64_t(sub_buckets) + bucket % sub_buckets) << (highest_bit - 3);
+        }
+
+        // Returns the duration below which the given share (0.0 - 1.0) of the recorded durations lie, e. g. 0.99 for the
+        // 99th percentile.
+        std::chrono::nanoseconds percentile(double share) const
+        {
+            const auto    target = static_cast<std::uint64_t>(share * static_cast<double>(count) + 0.5);
+            std::uint64_t seen   = 0;
+
+            for (std::size_t i = 0; i < bucket_count; ++i)
+            {
+                seen += counts[i];
+                if (seen >= target && seen != 0)
+                {
+                    const auto upper = std::chrono::nanoseconds(i + 1 < bucket_count ? lower_bound(i + 1) - 1 : lower_bound(i));
+                    return upper < max ? upper : max;
+                }
+            }
+            return max;
+        }
+    };
+
+    // Snapshot of the statistics of one message type, see message_manager::stats (requires CLIME_ENABLE_STATS).
+    struct message_stats
+    {
+        std::uint64_t                  enqueued{0};
+        std::uint64_t                  dequeued{0};
+        std::uint64_t                  dropped{0};         // messages that were cleared or dropped because the queue was full
+        std::uint64_t                  conflated{0};       // messages that were replaced by a later one with the same key
+        std::size_t                    queued{0};          // current queue length
+        std::size_t                    high_water_mark{0}; // maximum queue length so far
+        latency_histogram              latency;            // time between enqueueing and dequeueing a message
+        latency_histogram              handler_time;       // time handlers spent for a message (or a batch of messages)
+        std::vector<latency_histogram> handler_times;      // handler_time of each current handler, in the order they were added
+        std::chrono::nanoseconds       producer_blocked_time{0}; // total time senders waited because of max_queued_messages
+    };
+
+    // Defines how a handler with an idle function (on_idle) waits for messages.
+    struct idle_policy
+    {
+        enum class mode
+        {
+            poll,    // call on_idle whenever there is no message, without waiting
+            timeout, // wait up to max_wait for a message, call on_idle if none arrived
+            backoff, // poll spin_count times, then wait min_wait, doubling the wait up to max_wait while no message arrives
+            once     // call on_idle once whenever the queue has become empty, then wait for the next message
+        };
+
+        mode                      idle_mode{mode::poll};
+        std::chrono::microseconds min_wait{0};
+        std::chrono::microseconds max_wait{0};
+        unsigned int              spin_count{0};
+
+        static idle_policy poll() { return {}; }
+
+        static idle_policy wait_for(std::chrono::microseconds timeout) { return {mode::timeout, timeout, timeout, 0}; }
+
+        static idle_policy backoff(std::chrono::microseconds min_wait, std::chrono::microseconds max_wait, unsigned int spin_count = 16)
+        {
+            return {mode::backoff, min_wait, max_wait, spin_count};
+        }
+
+        static idle_policy once() { return {mode::once, {}, {}, 0}; }
+
+        // Returns how long to wait for a message after on_idle has been called idle_calls times since the last message.
+        std::chrono::microseconds next_wait(std::size_t idle_calls) const
+        {
+            switch (idle_mode)
+            {
+            case mode::timeout:
+                return max_wait;
+            case mode::backoff:
+            {
+                if (idle_calls < spin_count)
+                {
+                    return std::chrono::microseconds(0);
+                }
+
+                auto wait = min_wait.count() > 0 ? min_wait : std::chrono::microseconds(1);
+                for (std::size_t i = spin_count; i < idle_calls && wait < max_wait; ++i)
+                {
+                    wait *= 2;
+                }
+                return wait < max_wait ? wait : max_wait;
+            }
+            case mode::once:
+                return idle_calls == 0 ? std::chrono::microseconds(0) : std::chrono::microseconds::max();
+            default:
+                return std::chrono::microseconds(0);
+            }
+        }
+    };
+
+    struct handler_options
+    {
+        std::function<void(const std::exception& exception)> on_exception;
+        std::function<void()>                                on_idle; // only used by handlers with their own thread
+        std::function<void()>                                on_exit;
+        std::string                                          thread_name;
+        idle_policy                                          idle;   // how to wait for messages if on_idle is set
+        thread_options                                       thread; // only used by handlers with their own thread
+
+        // If set, the handler has no thread of its own, but runs as a task of task_executor whenever there are messages.
+        // task_executor must outlive the message_manager.
+        executor* task_executor{nullptr};
+    };
+
+    template <typename... MessageTypes>
+    class message_manager;
+
+    // Preallocated slots in which callers wait for replies, see message_manager::request. A ticket names a slot and its
+    // generation, so a late reply to a request that has timed out does not reach the next caller of the same slot.
+    template <typename Reply, std::size_t Slots>
+    class correlation_table
+    {
+        static_assert(Slots > 0, "a correlation_table needs at least 1 slot");
+
+    public:
+        struct ticket
+        {
+            std::uint32_t index{0};
+            std::uint32_t generation{0};
+        };
+
+        correlation_table()
+        {
+            free_.reserve(Slots);
+            for (std::size_t i = Slots; i > 0; --i)
+            {
+                free_.push_back(static_cast<std::uint32_t>(i - 1));
+            }
+        }
+
+        correlation_table(const correlation_table&)            = delete;
+        correlation_table& operator=(const correlation_table&) = delete;
+
+        // Returns false if all slots are in use.
+        bool acquire(ticket& t)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.empty())
+            {
+                return false;
+            }
+
+            t.index = free_.back();
+            free_.pop_back();
+            auto& s      = slots_[t.index];
+            s.state      = slot_state::waiting;
+            t.generation = s.generation;
+            return true;
+        }
+
+        // timeout is cancelled as soon as the slot has its reply
+        void set_timeout(ticket t, timer::handle timeout)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto&                       s = slots_[t.index];
+                if (s.generation == t.generation && s.state == slot_state::waiting)
+                {
+                    s.timeout = std::move(timeout);
+                    return;
+                }
+            }
+            timeout.cancel();
+        }
+
+        // Both return false if the caller does not wait for this reply anymore, e.g. because it has timed out.
+        bool reply(ticket t, Reply&& value)
+        {
+            return complete(t, [&](slot& s)
+                            { s.reply.emplace(std::move(value)); });
+        }
+
+        bool fail(ticket t, std::exception_ptr error)
+        {
+            return complete(t, [&](slot& s)
+                            { s.error = std::move(error); });
+        }
+
+        // completes the slot without a reply
+        bool expire(ticket t)
+        {
+            return complete(t, [](slot&) {});
+        }
+
+        // Expires all slots whose callers still wait and returns their number.
+        std::size_t expire_all()
+        {
+            std::size_t expired = 0;
+            for (std::uint32_t i = 0; i < Slots; ++i)
+            {
+                ticket t;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    t = ticket{i, slots_[i].generation};
+                }
+                expired += expire(t) ? 1 : 0;
+            }
+            return expired;
+        }
+
+        bool ready(ticket t) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return slots_[t.index].state == slot_state::done;
+        }
+
+        // Waits until the slot is completed, releases it and returns the reply. Rethrows the error of fail.
+        std::optional<Reply> take(ticket t)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto&                        s = slots_[t.index];
+            s.cv.wait(lock, [&]
+                      { return s.state == slot_state::done; });
+
+            std::optional<Reply> result = std::move(s.reply);
+            std::exception_ptr   error  = std::move(s.error);
+            release_slot(t);
+            lock.unlock();
+
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            return result;
+        }
+
+        // The caller gives up waiting, a reply that arrives later is dropped.
+        void release(ticket t)
+        {
+            timer::handle timeout;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                timeout = std::move(slots_[t.index].timeout);
+                release_slot(t);
+            }
+            timeout.cancel();
+        }
+
+#ifdef CLIME_HAS_COROUTINES
+        // Returns false if the slot is already completed, otherwise continuation is resumed as task of the
+        // default executor when it is.
+        bool suspend(ticket t, std::coroutine_handle<> continuation)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto&                       s = slots_[t.index];
+            if (s.state == slot_state::done)
+            {
+                return false;
+            }
+            s.continuation = continuation;
+            return true;
+        }
+#endif
+
+    private:
+        enum class slot_state
+        {
+            free,
+            waiting,
+            done
+        };
+
+        struct slot
+        {
+            std::condition_variable cv;
+            std::optional<Reply>    reply;
+            std::exception_ptr      error;
+            timer::handle           timeout;
+#ifdef CLIME_HAS_COROUTINES
+            std::coroutine_handle<> continuation;
+#endif
+            std::uint32_t generation{0};
+            slot_state    state{slot_state::free};
+        };
+
+        template <typename Function>
+        bool complete(ticket t, Function set_result)
+        {
+            auto&         s = slots_[t.index];
+            timer::handle timeout;
+#ifdef CLIME_HAS_COROUTINES
+            std::coroutine_handle<> continuation;
+#endif
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (s.generation != t.generation || s.state != slot_state::waiting)
+                {
+                    return false;
+                }
+                set_result(s);
+                s.state = slot_state::done;
+                timeout = std::move(s.timeout);
+#ifdef CLIME_HAS_COROUTINES
+                continuation = std::exchange(s.continuation, nullptr);
+#endif
+            }
+            s.cv.notify_all();
+            timeout.cancel();
+#ifdef CLIME_HAS_COROUTINES
+            if (continuation)
+            {
+                executor::default_executor().submit([continuation]
+                                                    { continuation.resume(); });
+            }
+#endif
+            return true;
+        }
+
+        void release_slot(ticket t) // called while holding mutex_
+        {
+            auto& s = slots_[t.index];
+            s.reply.reset();
+            s.error = nullptr;
+#ifdef CLIME_HAS_COROUTINES
+            s.continuation = nullptr; // e.g. of a coroutine that was destroyed while it waited, the next caller must not resume it
+#endif
+            s.state = slot_state::free;
+            ++s.generation;
+            free_.push_back(t.index);
+        }
+
+        mutable std::mutex         mutex_;
+        std::array<slot, Slots>    slots_;
+        std::vector<std::uint32_t> free_;
+    };
+
+    // Message type of requests that a handler answers with a Reply, see message_manager::request. Up to Slots requests
+    // of this type can wait for their replies at the same time.
+    template <typename Request, typename Reply, std::size_t Slots = 64>
+    class call
+    {
+    public:
+        using request_type = Request;
+        using reply_type   = Reply;
+        using table_type   = correlation_table<Reply, Slots>;
+
+        static constexpr std::size_t slots = Slots;
+
+        call() = default;
+
+        Request request;
+
+        // Passes value to the waiting caller. Returns false if the caller does not wait anymore, e.g. because it has
+        // timed out or another copy of this call has been answered already.
+        bool reply(Reply value) const { return table_ != nullptr && table_->reply(ticket_, std::move(value)); }
+
+        // The caller gets error rethrown by pending_reply::get.
+        bool fail(std::exception_ptr error) const { return table_ != nullptr && table_->fail(ticket_, std::move(error)); }
+
+    private:
+        template <typename... MessageTypes>
+        friend class message_manager;
+
+        call(Request msg, table_type* table, typename table_type::ticket t)
+            : request(std::move(msg))
+            , table_(table)
+            , ticket_(t)
+        {
+        }
+
+        table_type*                 table_{nullptr};
+        typename table_type::ticket ticket_;
+    };
+
+    // a call is queued without an allocation of its own
+    template <typename Request, typename Reply, std::size_t Slots>
+    struct storage_policy<call<Request, Reply, Slots>> : inline_storage
+    {
+    };
+
+    // Returned by message_manager::request. Destroying it without get gives up waiting for the reply. It must not
+    // outlive the message_manager.
+    template <typename Reply, std::size_t Slots>
+    class pending_reply
+    {
+    public:
+        pending_reply() = default;
+
+        pending_reply(pending_reply&& other) noexcept
+            : table_(std::exchange(other.table_, nullptr))
+            , ticket_(other.ticket_)
+        {
+        }
+
+        pending_reply& operator=(pending_reply&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                table_  = std::exchange(other.table_, nullptr);
+                ticket_ = other.ticket_;
+            }
+            return *this;
+        }
+
+        ~pending_reply()
+        {
+            reset();
+        }
+
+        // false if the request was not sent because all slots were in use, or after get
+        bool valid() const { return table_ != nullptr; }
+
+        bool ready() const { return table_ != nullptr && table_->ready(ticket_); }
+
+        // Waits for the reply and returns it. It is empty if the request has timed out, was not sent or the
+        // message_manager has been disposed. Rethrows the exception of the responder. Can be called once.
+        std::optional<Reply> get()
+        {
+            if (table_ == nullptr)
+            {
+                return std::nullopt;
+            }
+            return std::exchange(table_, nullptr)->take(ticket_);
+        }
+
+#ifdef CLIME_HAS_COROUTINES
+        // co_await on a pending_reply resumes the coroutine as task of the default executor.
+        bool await_ready() const { return table_ == nullptr || ready(); }
+        bool await_suspend(std::coroutine_handle<> handle) { return table_->suspend(ticket_, handle); }
+        std::optional<Reply> await_resume() { return get(); }
+#endif
+
+    private:
+        template <typename... MessageTypes>
+        friend class message_manager;
+
+        using table_type = correlation_table<Reply, Slots>;
+
+        pending_reply(table_type* table, typename table_type::ticket t)
+            : table_(table)
+            , ticket_(t)
+        {
+        }
+
+        void reset()
+        {
+            if (table_ != nullptr)
+            {
+                std::exchange(table_, nullptr)->release(ticket_);
+            }
+        }
+
+        table_type*                 table_{nullptr};
+        typename table_type::ticket ticket_;
+    };
+
+    template <typename... MessageTypes>
+    class message_manager
+    {
+    public:
+        // type in which messages of MessageType are passed to handlers and loggers, std::shared_ptr<MessageType> per default
+        template <typename MessageType>
+        using element_type = typename storage_policy<MessageType>::template element<MessageType>;
+
+        // type returned by receive_message, std::shared_ptr<MessageType> per default
+        template <typename MessageType>
+        using message_ptr = typename storage_policy<MessageType>::template pointer<MessageType>;
+
+        template <typename MessageType>
+        using logger_type = std::function<void(const element_type<MessageType>&, bool sending)>;
+
+        // called by the log writer thread, time is when the message was sent or received
+        template <typename MessageType>
+        using async_logger_type = std::function<void(const MessageType& message, bool sending, timer::clock::time_point time)>;
+
+    private:
+        template <typename MessageType>
+        struct is_message_type : std::disjunction<std::is_same<MessageType, MessageTypes>...>
+        {
+        };
+
+        // position of MessageType in MessageTypes
+        template <typename MessageType>
+        static constexpr std::size_t type_index()
+        {
+            constexpr bool matches[] = {std::is_same<MessageType, MessageTypes>::value...};
+            for (std::size_t i = 0; i < sizeof...(MessageTypes); ++i)
+            {
+                if (matches[i])
+                {
+                    return i;
+                }
+            }
+            return sizeof...(MessageTypes);
+        }
+
+        template <typename MessageType, typename Request, typename Reply>
+        struct is_call_of : std::false_type
+        {
+        };
+
+        template <typename Request, typename Reply, std::size_t Slots>
+        struct is_call_of<call<Request, Reply, Slots>, Request, Reply> : std::true_type
+        {
+        };
+
+        // position of the call<Request, Reply, Slots> in MessageTypes
+        template <typename Request, typename Reply>
+        static constexpr std::size_t call_index()
+        {
+            constexpr bool matches[] = {is_call_of<MessageTypes, Request, Reply>::value...};
+            for (std::size_t i = 0; i < sizeof...(MessageTypes); ++i)
+            {
+                if (matches[i])
+                {
+                    return i;
+                }
+            }
+            return sizeof...(MessageTypes);
+        }
+
+        template <typename Request, typename Reply>
+        using call_type = std::tuple_element_t<call_index<Request, Reply>(), std::tuple<MessageTypes...>>;
+
+        // channels of other message types than calls have no correlation slots
+        struct no_replies
+        {
+            std::size_t expire_all() { return 0; }
+        };
+
+        template <typename MessageType>
+        struct reply_table
+        {
+            using type = no_replies;
+        };
+
+        template <typename Request, typename Reply, std::size_t Slots>
+        struct reply_table<call<Request, Reply, Slots>>
+        {
+            using type = correlation_table<Reply, Slots>;
+        };
+
+        // A logger that may be replaced while other threads send and receive messages. A thread that is calling the
+        // logger keeps it alive, so it may even be replaced by the logger itself.
+        template <typename Logger>
+        class logger_slot
+        {
+        public:
+            bool is_set() const { return is_set_.load(std::memory_order_acquire); }
+
+            std::shared_ptr<const Logger> load() const
+            {
+                if (!is_set())
+                {
+                    return nullptr;
+                }
+#if defined(__cpp_lib_atomic_shared_ptr) && __cpp_lib_atomic_shared_ptr >= 201711L
+                return logger_.load();
+#else
+                return std::atomic_load(&logger_);
+#endif
+            }
+
+            void store(Logger logger)
+            {
+                std::shared_ptr<const Logger> stored = logger ? std::make_shared<const Logger>(std::move(logger)) : nullptr;
+                is_set_.store(stored != nullptr, std::memory_order_release);
+#if defined(__cpp_lib_atomic_shared_ptr) && __cpp_lib_atomic_shared_ptr >= 201711L
+                logger_.store(std::move(stored));
+#else
+                std::atomic_store(&logger_, std::move(stored));
+#endif
+            }
+
+        private:
+#if defined(__cpp_lib_atomic_shared_ptr) && __cpp_lib_atomic_shared_ptr >= 201711L
+            std::atomic<std::shared_ptr<const Logger>> logger_;
+#else
+            std::shared_ptr<const Logger> logger_;
+#endif
+            std::atomic<bool> is_set_{false};
+        };
+
+        // A thread that blocks in send_message or receive_message registers a waiter in the channel of the message
+        // type, so it can be woken up individually instead of waking all threads that wait on a shared condition.
+        struct waiter
+        {
+            std::condition_variable cv;
+            void                    (*wake)(waiter& w){nullptr}; // called instead of notifying cv, e.g. to resume a coroutine
+            std::size_t             max_queued_messages{0};      // only used by producers
+            std::size_t             consumer{static_cast<std::size_t>(-1)}; // only used by consumers of affine queues
+            bool                    notified{false};
+            bool                    linked{false};
+            waiter*                 prev{nullptr};
+            waiter*                 next{nullptr};
+
+            void notify()
+            {
+                notified = true;
+                if (wake != nullptr)
+                {
+                    wake(*this);
+                }
+                else
+                {
+                    cv.notify_one();
+                }
+            }
+        };
+
+        // intrusive FIFO list of waiters, must only be modified while holding the mutex of the channel
+        class waiter_list
+        {
+        public:
+            void push_back(waiter& w)
+            {
+                w.prev   = tail_;
+                w.next   = nullptr;
+                w.linked = true;
+                (tail_ ? tail_->next : head_) = &w;
+                tail_                         = &w;
+                size_.store(size_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+
+            void remove(waiter& w)
+            {
+                if (w.linked)
+                {
+                    (w.prev ? w.prev->next : head_) = w.next;
+                    (w.next ? w.next->prev : tail_) = w.prev;
+                    w.linked                        = false;
+                    size_.store(size_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+                }
+            }
+
+            template <typename Predicate>
+            bool notify_first(Predicate pred)
+            {
+                for (waiter* w = head_; w != nullptr; w = w->next)
+                {
+                    if (pred(*w))
+                    {
+                        remove(*w);
+                        w->notify();
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void notify_all()
+            {
+                while (head_ != nullptr)
+                {
+                    waiter& w = *head_;
+                    remove(w);
+                    w.notify();
+                }
+            }
+
+            // may be read without holding the mutex to find out if there is any waiter at all
+            std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+        private:
+            waiter*                  head_{nullptr};
+            waiter*                  tail_{nullptr};
+            std::atomic<std::size_t> size_{0};
+        };
+
+        // Wakes shutdown while it drains the queues whenever a message was received or a delayed message was sent. The
+        // waiter checks whether it is done without holding mutex, so it compares generation to see if it missed a call
+        // of notify.
+        struct drain_signal
+        {
+            std::mutex              mutex;
+            std::condition_variable cv;
+            std::uint64_t           generation{0};
+
+            void notify()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++generation;
+                cv.notify_all();
+            }
+        };
+
+#ifdef CLIME_ENABLE_STATS
+        // per channel counters, updated without locking, so they may be read while messages are sent and received
+        class channel_stats
+        {
+        public:
+            struct histogram
+            {
+                std::array<std::atomic<std::uint64_t>, latency_histogram::bucket_count> counts{};
+                std::atomic<std::uint64_t>                                              max{0};
+
+                latency_histogram snapshot() const
+                {
+                    latency_histogram result;
+                    for (std::size_t i = 0; i < latency_histogram::bucket_count; ++i)
+                    {
+                        result.counts[i] = counts[i].load(std::memory_order_relaxed);
+                        result.count += result.counts[i];
+                    }
+                    result.max = std::chrono::nanoseconds(max.load(std::memory_order_relaxed));
+                    return result;
+                }
+            };
+
+            static timer::clock::time_point now() { return timer::clock::now(); }
+
+            void on_enqueue(std::size_t queued)
+            {
+                enqueued_.fetch_add(1, std::memory_order_relaxed);
+                std::size_t high_water_mark = high_water_mark_.load(std::memory_order_relaxed);
+                while (queued > high_water_mark && !high_water_mark_.compare_exchange_weak(high_water_mark, queued, std::memory_order_relaxed))
+                {
+                }
+            }
+
+            void on_dequeue(timer::clock::time_point enqueued)
+            {
+                on_dequeue();
+                record(latency_, now() - enqueued);
+            }
+
+            // for messages whose latency is not known, see channel::persistent
+            void on_dequeue() { dequeued_.fetch_add(1, std::memory_order_relaxed); }
+
+            void on_drop(std::size_t count = 1) { dropped_.fetch_add(count, std::memory_order_relaxed); }
+
+            void on_conflate() { conflated_.fetch_add(1, std::memory_order_relaxed); }
+
+            // handler is the histogram of the handler, see add_handler
+            void on_handled(histogram& handler, timer::clock::time_point started)
+            {
+                const auto elapsed = now() - started;
+                record(handler_time_, elapsed);
+                record(handler, elapsed);
+            }
+
+            // Returns the histogram of a new handler, which stays valid until remove_handlers is called.
+            histogram& add_handler()
+            {
+                std::lock_guard<std::mutex> lock(handlers_mutex_);
+                return handler_times_.emplace_back();
+            }
+
+            void remove_handlers()
+            {
+                std::lock_guard<std::mutex> lock(handlers_mutex_);
+                handler_times_.clear();
+            }
+
+            void on_unblocked(timer::clock::time_point blocked_since)
+            {
+                blocked_.fetch_add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now() - blocked_since).count()),
+                                   std::memory_order_relaxed);
+            }
+
+            message_stats snapshot(std::size_t queued) const
+            {
+                message_stats result;
+                result.enqueued              = enqueued_.load(std::memory_order_relaxed);
+                result.dequeued              = dequeued_.load(std::memory_order_relaxed);
+                result.dropped               = dropped_.load(std::memory_order_relaxed);
+                result.conflated             = conflated_.load(std::memory_order_relaxed);
+                result.queued                = queued;
+                result.high_water_mark       = high_water_mark_.load(std::memory_order_relaxed);
+                result.latency               = latency_.snapshot();
+                result.handler_time          = handler_time_.snapshot();
+                result.producer_blocked_time = std::chrono::nanoseconds(blocked_.load(std::memory_order_relaxed));
+
+                std::lock_guard<std::mutex> lock(handlers_mutex_);
+                for (const auto& handler : handler_times_)
+                {
+                    result.handler_times.push_back(handler.snapshot());
+                }
+                return result;
+            }
+
+        private:
+            static void record(histogram& h, timer::clock::duration elapsed)
+            {
+                const auto nanoseconds = static_cast<std::uint64_t>(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+                h.counts[latency_histogram::bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+
+                std::uint64_t max = h.max.load(std::memory_order_relaxed);
+                while (nanoseconds > max && !h.max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed))
+                {
+                }
+            }
+
+            // updated by producers
+            alignas(cache_line_size) std::atomic<std::uint64_t> enqueued_{0};
+            std::atomic<std::uint64_t>                          dropped_{0};
+            std::atomic<std::uint64_t>                          conflated_{0};
+            std::atomic<std::size_t>                            high_water_mark_{0};
+            std::atomic<std::uint64_t>                          blocked_{0}; // nanoseconds
+
+            // updated by consumers
+            alignas(cache_line_size) std::atomic<std::uint64_t> dequeued_{0};
+            histogram                                           latency_;
+            histogram                                           handler_time_;
+
+            // updated when handlers are added or removed
+            mutable std::mutex   handlers_mutex_;
+            std::list<histogram> handler_times_;
+        };
+
+        // queued messages carry the time they were sent to measure their latency
+        template <typename ElementType>
+        using queued_element = timestamped<ElementType>;
+#else
+        // does nothing, so all calls are optimized away
+        struct channel_stats
+        {
+            struct histogram
+            {
+            };
+
+            static timer::clock::time_point now() { return {}; }
+            void                            on_enqueue(std::size_t) {}
+            void                            on_drop(std::size_t = 1) {}
+            void                            on_handled(histogram&, timer::clock::time_point) {}
+            void                            on_unblocked(timer::clock::time_point) {}
+            void                            remove_handlers() {}
+
+            histogram& add_handler()
+            {
+                static histogram unused;
+                return unused;
+            }
+        };
+
+        template <typename ElementType>
+        using queued_element = ElementType;
+#endif
+
+        // Each message type has its own queue, lock and wait state, so producers and consumers of different
+        // message types never block each other.
+        template <typename MessageType>
+        struct channel
+        {
+            using element_type = typename storage_policy<MessageType>::template element<MessageType>;
+            using plain_queue  = typename queue_policy<MessageType>::template queue<element_type>;
+
+            // Messages in shared memory or a journal are stored without the time they were sent, so that their layout
+            // does not depend on CLIME_ENABLE_STATS and a steady_clock time of one process is not read by another one.
+            static constexpr bool persistent = is_shared_memory_queue<plain_queue>::value || is_journaled_queue<plain_queue>::value;
+
+            using stored_element = std::conditional_t<persistent, element_type, queued_element<element_type>>;
+            using queue_type     = typename queue_policy<MessageType>::template queue<stored_element>;
+            using subscriber     = typename is_broadcast_queue<queue_type>::subscriber;
+
+            // handlers that run as tasks of an executor, guarded by mutex
+            struct task_consumer
+            {
+                std::function<void(element_type)>                    on_message;
+                std::function<void(const std::exception& exception)> on_exception;
+                std::function<void()>                                on_exit;
+                std::function<void()>                                task; // drains the queue, submitted to task_executor
+                executor*                                            task_executor{nullptr};
+                typename channel_stats::histogram*                   handler_time{nullptr}; // see message_stats::handler_times
+                std::size_t                                          consumer{0}; // only used by affine queues
+                subscriber                                           cursor{}; // only used by broadcast queues
+                bool                                                 scheduled{false};
+            };
+
+            static constexpr bool        affine          = is_affine_queue<queue_type>::value;
+            static constexpr bool        broadcast       = is_broadcast_queue<queue_type>::value;
+            static constexpr bool        shared          = is_shared_memory_queue<queue_type>::value;
+            static constexpr bool        journaled       = is_journaled_queue<queue_type>::value;
+            static constexpr bool        single_consumer = is_single_consumer_queue<queue_type>::value;
+            static constexpr bool        conflating      = is_conflating_queue<queue_type>::value;
+            static constexpr std::size_t any_shard       = static_cast<std::size_t>(-1);
+            static constexpr std::size_t no_consumer     = static_cast<std::size_t>(-1); // receivers that are not handlers
+
+            static constexpr wait_strategy strategy   = wait_policy<MessageType>::strategy;
+            static constexpr unsigned int  spin_count = wait_policy<MessageType>::spin_count;
+
+            static constexpr bool logging      = !feature_policy<MessageType>::template removed<no_logging>;
+            static constexpr bool backpressure = !feature_policy<MessageType>::template removed<no_backpressure>;
+
+            // The members are grouped by the threads that write them, each group on cache lines of its own, so that
+            // e.g. handlers that check running do not slow down producers that lock mutex. The queues and stats
+            // separate their producer and consumer sides themselves.
+            queue_type    messages;
+            channel_stats stats;
+
+            // read by every producer, but rarely modified
+            alignas(cache_line_size) std::atomic<std::size_t> capacity{0}; // used if a message is sent with max_queued_messages 0
+            std::atomic<overflow_policy>                      overflow{overflow_policy::block};
+            std::shared_ptr<block_pool>                       pool = std::make_shared<block_pool>(); // used by message_manager::acquire
+            typename reply_table<MessageType>::type           replies;                               // used by message_manager::request
+
+            alignas(cache_line_size) mutable std::mutex mutex;
+            waiter_list                                 consumers;
+            waiter_list                                 producers;
+            std::size_t                                 next_consumer{0}; // number of handlers of an affine queue, guarded by mutex
+            std::list<task_consumer>                    task_consumers;
+            std::condition_variable                     task_finished;
+            std::size_t                                 suspended_coroutines{0}; // that wait in async_receive or async_send, guarded by mutex
+
+            alignas(cache_line_size) std::atomic<bool> running{true};               // only modified while holding mutex
+            std::atomic<unsigned int>                  spin_budget{spin_count};     // used by wait_strategy::adaptive
+            std::atomic<drain_signal*>                 drain{nullptr};              // notified by dequeue while shutdown drains
+            alignas(cache_line_size) std::atomic<std::size_t> idle_task_consumers{0}; // read by every producer
+
+            enum class wait_status
+            {
+                done,
+                waiting,
+                stopped
+            };
+
+            // Returns false if value was dropped because the queue is full. If overflow is overflow_policy::block, it waits
+            // until deadline for space, time_point::max() waits forever and time_point::min() does not wait.
+            bool push(element_type& value, std::size_t max_queued_messages, timer::clock::time_point deadline = timer::clock::time_point::max())
+            {
+                const std::size_t shard    = shard_of(value);
+                const std::size_t limit    = limit_of(max_queued_messages);
+                auto              try_push = [&]
+                { return (limit == 0 || messages.size() < limit) && enqueue(value); };
+
+                if constexpr (queue_type::lock_free)
+                {
+                    // only take the lock if the ring is full (or max_queued_messages is reached) or a consumer waits
+                    if (try_push())
+                    {
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        if (has_idle_consumers())
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            notify_consumer(shard);
+                        }
+                        return true;
+                    }
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!try_push() && !push_full(lock, value, limit, try_push, deadline))
+                {
+                    return false;
+                }
+                notify_consumer(shard);
+                return true;
+            }
+
+            bool pop(element_type& value, bool wait_for_message)
+            {
+                return pop(value, wait_for_message ? timer::clock::time_point::max() : timer::clock::time_point::min());
+            }
+
+            // Waits until deadline for a message, time_point::max() waits forever and time_point::min() does not wait.
+            // consumer is the handler that receives it, see add_consumer.
+            bool pop(element_type& value, timer::clock::time_point deadline, std::size_t consumer = no_consumer)
+            {
+                const bool wait_for_message = deadline != timer::clock::time_point::min();
+                auto       try_pop          = [&]
+                { return dequeue(value, consumer); };
+
+                release(consumer);
+                if constexpr (queue_type::lock_free)
+                {
+                    if (pop_lock_free(value, consumer))
+                    {
+                        return true;
+                    }
+                    if (!wait_for_message)
+                    {
+                        return false;
+                    }
+                }
+
+                if constexpr (strategy != wait_strategy::park)
+                {
+                    if (wait_for_message && spin_pop(value, deadline, consumer))
+                    {
+                        return true;
+                    }
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                waiter                       w;
+                w.consumer          = consumer;
+                const bool received = wait_for_message ? wait(lock, consumers, w, try_pop, deadline) : try_pop();
+
+                if (received)
+                {
+                    notify_producer();
+                }
+                return received;
+            }
+
+            template <typename ForwardIt>
+            void push_batch(ForwardIt first, ForwardIt last, std::size_t max_queued_messages)
+            {
+                const std::size_t limit    = limit_of(max_queued_messages);
+                auto              try_push = [&](element_type& value)
+                { return (limit == 0 || messages.size() < limit) && enqueue(value); };
+
+                std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+                std::size_t                  pending_notifications = 0;
+
+                if constexpr (!queue_type::lock_free)
+                {
+                    lock.lock();
+                }
+
+                for (; first != last; ++first)
+                {
+                    element_type value = *first;
+                    if (try_push(value))
+                    {
+                        ++pending_notifications;
+                        continue;
+                    }
+
+                    if (!lock.owns_lock())
+                    {
+                        lock.lock();
+                    }
+
+                    // consumers need to know about the messages sent so far, otherwise the queue never becomes shorter
+                    notify_consumers(pending_notifications);
+                    pending_notifications = 0;
+
+                    if (push_full(lock, value, limit, [&]
+                                  { return try_push(value); },
+                                  timer::clock::time_point::max()))
+                    {
+                        ++pending_notifications;
+                    }
+                }
+
+                if (!lock.owns_lock())
+                {
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (!has_idle_consumers())
+                    {
+                        return;
+                    }
+                    lock.lock();
+                }
+                notify_consumers(pending_notifications);
+            }
+
+            // passes up to max_count received elements to sink and returns their number
+            template <typename Sink>
+            std::size_t pop_batch(Sink sink, std::size_t max_count, bool wait_for_message)
+            {
+                return pop_batch(sink, max_count, wait_for_message ? timer::clock::time_point::max() : timer::clock::time_point::min());
+            }
+
+            template <typename Sink>
+            std::size_t pop_batch(Sink sink, std::size_t max_count, timer::clock::time_point deadline, std::size_t consumer = no_consumer)
+            {
+                element_type value;
+                auto         try_pop = [&]
+                { return dequeue(value, consumer); };
+
+                release(consumer);
+
+                std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+                std::size_t                  received = 0;
+
+                if constexpr (!queue_type::lock_free)
+                {
+                    lock.lock();
+                }
+
+                if (max_count == 0)
+                {
+                    return 0;
+                }
+
+                std::size_t notified = 0; // spin_pop notifies a producer for the message it receives
+                if (!try_pop())
+                {
+                    if (deadline == timer::clock::time_point::min())
+                    {
+                        return 0;
+                    }
+
+                    if constexpr (strategy != wait_strategy::park)
+                    {
+                        if (lock.owns_lock())
+                        {
+                            lock.unlock();
+                        }
+                        if (spin_pop(value, deadline, consumer))
+                        {
+                            notified = 1;
+                        }
+                    }
+
+                    if (!lock.owns_lock() && (notified == 0 || !queue_type::lock_free))
+                    {
+                        lock.lock();
+                    }
+
+                    waiter w;
+                    w.consumer = consumer;
+                    if (notified == 0 && !wait(lock, consumers, w, try_pop, deadline))
+                    {
+                        return 0;
+                    }
+                }
+
+                do
+                {
+                    sink(value);
+                } while (++received < max_count && try_pop());
+
+                if (!lock.owns_lock())
+                {
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (producers.size() == 0)
+                    {
+                        return received;
+                    }
+                    lock.lock();
+                }
+                notify_producers(received - notified);
+                return received;
+            }
+
+            // returns the number of dropped messages
+            std::size_t clear()
+            {
+                stored_element              value;
+                std::lock_guard<std::mutex> lock(mutex);
+                std::size_t                 dropped = 0;
+                while (discard_oldest(value))
+                {
+                    stats.on_drop();
+                    ++dropped;
+                }
+                producers.notify_all();
+                return dropped;
+            }
+
+            std::size_t size() const
+            {
+                if constexpr (queue_type::lock_free)
+                {
+                    return messages.size();
+                }
+                else
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    return messages.size();
+                }
+            }
+
+            void stop()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running = false;
+                consumers.notify_all();
+                producers.notify_all();
+                if constexpr (shared)
+                {
+                    messages.interrupt();
+                }
+            }
+
+            // Must be called while holding mutex. Pops a message or, if there is none, registers w, so that w.wake is
+            // called as soon as a message may be available.
+            wait_status pop_or_register(element_type& value, waiter& w)
+            {
+                w.consumer        = no_consumer;
+                const auto status = attempt_or_register(consumers, w, [&]
+                                                        { return dequeue(value, no_consumer); });
+                if (status == wait_status::done)
+                {
+                    notify_producer();
+                }
+                return status;
+            }
+
+            // Must be called while holding mutex. Pushes value or, if the queue is full, registers w, so that w.wake is
+            // called as soon as there may be space.
+            wait_status push_or_register(element_type& value, std::size_t max_queued_messages, waiter& w)
+            {
+                const std::size_t shard = shard_of(value);
+                const std::size_t limit = limit_of(max_queued_messages);
+                w.max_queued_messages   = limit;
+                auto status             = attempt_or_register(producers, w, [&]
+                                                              { return (limit == 0 || messages.size() < limit) && enqueue(value); });
+                if (status == wait_status::stopped && enqueue(value))
+                {
+                    status = wait_status::done; // shutting down, so there is no reason to wait until the queue is shorter
+                }
+                if (status == wait_status::done)
+                {
+                    notify_consumer(shard);
+                }
+                return status;
+            }
+
+            // Removes the messages that the calling thread has received from a journaled queue from its journal.
+            void acknowledge()
+            {
+                if constexpr (journaled)
+                {
+                    messages.acknowledge();
+                }
+            }
+
+            // Keeps the messages that the calling thread has received from a journaled queue in its journal, so that
+            // they are received again after the next start.
+            void abandon()
+            {
+                if constexpr (journaled)
+                {
+                    messages.abandon();
+                }
+            }
+
+            // Passes the messages that the calling thread has just received to handle and acknowledges them only if
+            // it returns. If it throws, they are received again or moved to the dead letters (see journaled_queue).
+            template <typename Handle>
+            void handle_received(Handle&& handle)
+            {
+                if constexpr (journaled)
+                {
+                    try
+                    {
+                        handle();
+                    }
+                    catch (...)
+                    {
+                        if (const std::size_t retried = messages.retry())
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            notify_consumers(retried);
+                        }
+                        throw;
+                    }
+                    messages.acknowledge();
+                }
+                else
+                {
+                    handle();
+                }
+            }
+
+            // Must be called while holding mutex by a consumer that was notified, but does not receive a message.
+            void pass_on_notification()
+            {
+                notify_consumer();
+            }
+
+            task_consumer& add_task_consumer()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                const std::size_t           consumer = add_consumer();
+                task_consumers.emplace_back();
+                task_consumers.back().consumer = consumer;
+                if constexpr (broadcast)
+                {
+                    task_consumers.back().cursor = messages.subscribe();
+                }
+                return task_consumers.back();
+            }
+
+            // Adds a subscriber that receives all messages sent from now on (broadcast queues only, other queues return
+            // a dummy). It must be removed with unsubscribe.
+            subscriber subscribe()
+            {
+                if constexpr (broadcast)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    return messages.subscribe();
+                }
+                else
+                {
+                    return {};
+                }
+            }
+
+            void unsubscribe(subscriber s)
+            {
+                if constexpr (broadcast)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    messages.unsubscribe(s);
+                    producers.notify_all(); // s may have been the slowest subscriber
+                }
+            }
+
+            // receives the next message of s, see pop above (broadcast queues only)
+            bool pop(subscriber s, element_type& value, timer::clock::time_point deadline)
+            {
+                const auto previous = messages.bind_consumer(s);
+                const bool received = pop(value, deadline);
+                messages.restore_binding(previous);
+                return received;
+            }
+
+            // binds the calling thread, which receives messages until the channel is stopped, to cursor
+            void bind_consumer_thread(subscriber cursor)
+            {
+                if constexpr (broadcast)
+                {
+                    messages.bind_consumer(cursor);
+                }
+            }
+
+            // binds the thread that runs the task of consumer to its cursor
+            void bind_task_consumer(const task_consumer& consumer)
+            {
+                if constexpr (broadcast)
+                {
+                    messages.bind_consumer(consumer.cursor);
+                }
+            }
+
+            // Must be called while holding mutex. Returns the number of a new handler, which receives the messages of
+            // its shards with pop(value, deadline, consumer). Throws std::length_error if an affine queue would have
+            // more handlers than shards, since two handlers of a shard would receive messages with the same key.
+            std::size_t add_consumer()
+            {
+                if constexpr (affine)
+                {
+                    if (next_consumer == queue_type::shards)
+                    {
+                        throw std::length_error("an affine sharded_queue needs one handler per shard at most");
+                    }
+                    messages.set_consumers(next_consumer + 1);
+                    return next_consumer++;
+                }
+                else
+                {
+                    return no_consumer;
+                }
+            }
+
+            // called when all handlers have been removed
+            void remove_consumers()
+            {
+                if constexpr (affine)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    next_consumer = 0;
+                    messages.set_consumers(0);
+                }
+            }
+
+            // consumer has handled the messages that it received before, so their shards may be taken over
+            void release(std::size_t consumer)
+            {
+                if constexpr (affine)
+                {
+                    if (consumer != no_consumer && messages.release(consumer))
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        notify_consumers(1);
+                    }
+                }
+            }
+
+            void start_task_consumer(task_consumer& consumer)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++idle_task_consumers;
+                if (has_messages_for(consumer))
+                {
+                    schedule(consumer);
+                }
+            }
+
+            // Called by a task consumer that found no more messages. Returns false if messages arrived meanwhile, so
+            // the consumer needs to continue.
+            bool finish_task(task_consumer& consumer)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                consumer.scheduled = false;
+                ++idle_task_consumers;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (running && has_messages_for(consumer))
+                {
+                    consumer.scheduled = true;
+                    --idle_task_consumers;
+                    return false;
+                }
+
+                task_finished.notify_all();
+                return true;
+            }
+
+            // waits until all task consumers have finished, the channel must have been stopped
+            void remove_task_consumers()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                task_finished.wait(lock, [&]
+                                   {
+                                       if (suspended_coroutines != 0)
+                                       {
+                                           return false;
+                                       }
+                                       for (const auto& consumer : task_consumers)
+                                       {
+                                           if (consumer.scheduled)
+                                           {
+                                               return false;
+                                           }
+                                       }
+                                       return true; });
+                idle_task_consumers = 0;
+                std::list<task_consumer> removed;
+                removed.swap(task_consumers);
+                if constexpr (broadcast)
+                {
+                    for (const auto& consumer : removed)
+                    {
+                        messages.unsubscribe(consumer.cursor);
+                    }
+                    producers.notify_all();
+                }
+                lock.unlock();
+
+                for (const auto& consumer : removed)
+                {
+                    if (consumer.on_exit)
+                    {
+                        consumer.on_exit();
+                    }
+                }
+            }
+
+        private:
+            // maximum queue length for a message that is sent with max_queued_messages, 0 means unlimited
+            std::size_t limit_of(std::size_t max_queued_messages) const
+            {
+                if constexpr (backpressure)
+                {
+                    return max_queued_messages != 0 ? max_queued_messages : capacity.load(std::memory_order_relaxed);
+                }
+                else
+                {
+                    return 0;
+                }
+            }
+
+            // only takes the lock if a producer waits
+            bool pop_lock_free(element_type& value, std::size_t consumer)
+            {
+                if (!dequeue(value, consumer))
+                {
+                    return false;
+                }
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (producers.size() != 0)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    notify_producer();
+                }
+                return true;
+            }
+
+            // Checks the queue according to the wait_strategy before the caller parks. Returns true if a message was
+            // received meanwhile.
+            bool spin_pop(element_type& value, timer::clock::time_point deadline, std::size_t consumer)
+            {
+                const unsigned int spins    = strategy == wait_strategy::adaptive ? spin_budget.load(std::memory_order_relaxed) : spin_count;
+                bool               received = false;
+
+                for (unsigned int i = 0; !received && (strategy == wait_strategy::busy_spin || i < spins); ++i)
+                {
+                    if constexpr (strategy == wait_strategy::yield)
+                    {
+                        std::this_thread::yield();
+                    }
+                    else if constexpr (strategy != wait_strategy::busy_spin)
+                    {
+                        cpu_pause();
+                    }
+
+                    if constexpr (queue_type::lock_free)
+                    {
+                        received = pop_lock_free(value, consumer);
+                    }
+                    else
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        received = dequeue(value, consumer);
+                        if (received)
+                        {
+                            notify_producer();
+                        }
+                    }
+
+                    // the clock is read rarely, since it costs more than a check of the queue
+                    if (!received && (i % 64 == 63) &&
+                        (!running || (deadline != timer::clock::time_point::max() && timer::clock::now() >= deadline)))
+                    {
+                        return false;
+                    }
+                }
+
+                if constexpr (strategy == wait_strategy::adaptive)
+                {
+                    const unsigned int budget = received ? std::min(spins * 2, spin_count) : std::max(spins / 2, 1u);
+                    spin_budget.store(budget, std::memory_order_relaxed);
+                }
+                return received;
+            }
+
+            template <typename Attempt>
+            wait_status attempt_or_register(waiter_list& list, waiter& w, Attempt attempt)
+            {
+                if (attempt())
+                {
+                    return wait_status::done;
+                }
+                if (!running)
+                {
+                    return wait_status::stopped;
+                }
+
+                w.notified = false;
+                list.push_back(w);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (attempt())
+                {
+                    list.remove(w);
+                    return wait_status::done;
+                }
+                return wait_status::waiting;
+            }
+
+            // Called with mutex locked if value could not be pushed because the queue is full. Applies the overflow
+            // policy and returns false if value was dropped.
+            template <typename TryPush>
+            bool push_full(std::unique_lock<std::mutex>& lock, element_type& value, std::size_t limit, TryPush try_push, timer::clock::time_point deadline)
+            {
+                bool pushed = false;
+                switch (overflow.load(std::memory_order_relaxed))
+                {
+                case overflow_policy::drop_oldest:
+                {
+                    stored_element oldest;
+                    while (!pushed && discard_oldest(oldest))
+                    {
+                        stats.on_drop();
+                        pushed = try_push();
+                    }
+                    break;
+                }
+                case overflow_policy::drop_newest:
+                    break;
+                default:
+                    if (deadline != timer::clock::time_point::min())
+                    {
+                        waiter w;
+                        w.max_queued_messages    = limit;
+                        const auto blocked_since = stats.now();
+                        pushed                   = wait(lock, producers, w, try_push, deadline);
+                        stats.on_unblocked(blocked_since);
+                    }
+                }
+
+                if (!pushed && !running)
+                {
+                    pushed = enqueue(value); // shutting down, so there is no reason to wait until the queue is shorter
+                }
+                if (!pushed)
+                {
+                    stats.on_drop();
+                }
+                return pushed;
+            }
+
+            bool try_pop(stored_element& value, std::size_t consumer)
+            {
+                if constexpr (affine)
+                {
+                    return messages.try_pop(value, consumer);
+                }
+                else
+                {
+                    return messages.try_pop(value);
+                }
+            }
+
+            // removes the oldest message, for broadcast queues the one that the slowest subscriber has not received yet,
+            // for affine queues the first one of the longest shard
+            bool discard_oldest(stored_element& value)
+            {
+                if constexpr (broadcast || journaled || affine)
+                {
+                    return messages.try_discard(value);
+                }
+                else
+                {
+                    return messages.try_pop(value);
+                }
+            }
+
+            // push and pop of the queue that keep the statistics up to date
+            bool enqueue(element_type& value)
+            {
+#ifdef CLIME_ENABLE_STATS
+                if constexpr (persistent)
+                {
+                    if (!messages.try_push(value))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    queued_element<element_type> queued{std::move(value), stats.now()};
+                    const std::size_t            size = conflating ? messages.size() : 0;
+                    if (!messages.try_push(queued))
+                    {
+                        value = std::move(queued.value);
+                        return false;
+                    }
+                    if (conflating && messages.size() == size)
+                    {
+                        stats.on_conflate(); // replaced a queued message with the same key
+                    }
+                }
+                stats.on_enqueue(messages.size());
+                return true;
+#else
+                return messages.try_push(value);
+#endif
+            }
+
+            bool dequeue(element_type& value, std::size_t consumer)
+            {
+#ifdef CLIME_ENABLE_STATS
+                if constexpr (persistent)
+                {
+                    if (!try_pop(value, consumer))
+                    {
+                        return false;
+                    }
+                    stats.on_dequeue();
+                }
+                else
+                {
+                    queued_element<element_type> queued;
+                    if (!try_pop(queued, consumer))
+                    {
+                        return false;
+                    }
+                    stats.on_dequeue(queued.enqueued);
+                    value = std::move(queued.value);
+                }
+#else
+                if (!try_pop(value, consumer))
+                {
+                    return false;
+                }
+#endif
+                if (auto* signal = drain.load(std::memory_order_acquire))
+                {
+                    signal->notify();
+                }
+                return true;
+            }
+
+            // Calls attempt until it succeeds (returns true) or the channel is stopped or deadline is reached (returns
+            // false). Waiters are registered before attempt is repeated, so lock-free queues that are modified without
+            // holding mutex cannot miss a wakeup.
+            template <typename Attempt>
+            bool wait(std::unique_lock<std::mutex>& lock,
+                      waiter_list&                  list,
+                      waiter&                       w,
+                      Attempt                       attempt,
+                      timer::clock::time_point      deadline = timer::clock::time_point::max())
+            {
+                while (!attempt())
+                {
+                    if (!running || (deadline != timer::clock::time_point::max() && timer::clock::now() >= deadline))
+                    {
+                        return false;
+                    }
+
+                    if constexpr (shared)
+                    {
+                        // producers and consumers of other processes cannot notify w, so wait until the queue has changed
+                        const bool consumer = &list == &consumers;
+                        const auto epoch    = messages.epoch(consumer);
+                        if (attempt())
+                        {
+                            return true;
+                        }
+                        lock.unlock();
+                        messages.wait(consumer, epoch, deadline);
+                        lock.lock();
+                        continue;
+                    }
+
+                    w.notified = false;
+                    list.push_back(w);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                    if (attempt())
+                    {
+                        list.remove(w);
+                        return true;
+                    }
+
+                    auto woken = [&]
+                    { return w.notified || !running; };
+
+                    if (deadline == timer::clock::time_point::max())
+                    {
+                        w.cv.wait(lock, woken);
+                    }
+                    else
+                    {
+                        w.cv.wait_until(lock, deadline, woken);
+                    }
+                    list.remove(w);
+                }
+                return true;
+            }
+
+            bool has_idle_consumers() const
+            {
+                return consumers.size() != 0 || idle_task_consumers.load() != 0;
+            }
+
+            // wakes a consumer that may receive a message of the given shard (affine queues) or any consumer
+            bool notify_consumer(std::size_t shard = any_shard)
+            {
+                if constexpr (broadcast)
+                {
+                    notify_consumers(1); // every subscriber receives the message
+                    return true;
+                }
+
+                if (consumers.notify_first([&](const waiter& w)
+                                           { return accepts(w.consumer, shard); }))
+                {
+                    return true;
+                }
+
+                if (idle_task_consumers.load(std::memory_order_relaxed) != 0)
+                {
+                    for (auto& consumer : task_consumers)
+                    {
+                        if (!consumer.scheduled && accepts(consumer.consumer, shard))
+                        {
+                            schedule(consumer);
+                            return true;
+                        }
+                    }
+                }
+                return false;
+            }
+
+            void schedule(task_consumer& consumer)
+            {
+                consumer.scheduled = true;
+                --idle_task_consumers;
+                consumer.task_executor->submit(consumer.task);
+            }
+
+            bool notify_producer()
+            {
+                if constexpr (!backpressure)
+                {
+                    // producers only wait for space in a full queue
+                    return producers.notify_first([](const waiter&)
+                                                  { return true; });
+                }
+
+                // wake the first producer that is allowed to send, other producers may have set a lower max_queued_messages
+                const std::size_t queued = messages.size();
+                return producers.notify_first([&](const waiter& w)
+                                              { return w.max_queued_messages == 0 || queued < w.max_queued_messages; });
+            }
+
+            void notify_consumers(std::size_t count)
+            {
+                if constexpr (affine || broadcast)
+                {
+                    // the messages may belong to any shard or all subscribers, so every consumer needs to check its own one
+                    if (count != 0)
+                    {
+                        consumers.notify_all();
+                        for (auto& consumer : task_consumers)
+                        {
+                            if (!consumer.scheduled && has_messages_for(consumer))
+                            {
+                                schedule(consumer);
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    while (count-- > 0 && notify_consumer())
+                    {
+                    }
+                }
+            }
+
+            std::size_t shard_of(const element_type& value) const
+            {
+                if constexpr (affine)
+                {
+                    return messages.shard_of(value);
+                }
+                else
+                {
+                    return any_shard;
+                }
+            }
+
+            // true if consumer may receive a message of shard
+            bool accepts(std::size_t consumer, std::size_t shard) const
+            {
+                if constexpr (affine)
+                {
+                    return shard == any_shard || consumer == no_consumer || messages.owner_of(shard) == consumer;
+                }
+                else
+                {
+                    return true;
+                }
+            }
+
+            bool has_messages_for(const task_consumer& consumer) const
+            {
+                if constexpr (affine)
+                {
+                    return messages.has_messages_for(consumer.consumer);
+                }
+                else if constexpr (broadcast)
+                {
+                    return !messages.empty(consumer.cursor);
+                }
+                else
+                {
+                    return !messages.empty();
+                }
+            }
+
+            void notify_producers(std::size_t count)
+            {
+                while (count-- > 0 && notify_producer())
+                {
+                }
+            }
+        };
+
+        template <typename MessageType>
+        class message_handler
+        {
+        public:
+            message_handler(message_manager&                                            msg_manager,
+                            const std::function<void(const std::exception& exception)>& on_exception = nullptr,
+                            const std::string&                                          thread_name  = {})
+                : msg_manager_(msg_manager)
+                , on_exception_(on_exception)
+                , thread_name_(thread_name.empty() ? CLIME_DEMANGLED_CLASS_NAME(demangling_status_) : thread_name)
+            {
+            }
+
+            virtual ~message_handler()
+            {
+                try
+                {
+                    msg_manager_.template get_channel<MessageType>().stop();
+
+                    if (thread_.joinable())
+                    {
+                        thread_.join();
+                    }
+                }
+                catch (const std::exception& ex)
+                {
+                    if (on_exception_)
+                    {
+                        on_exception_(ex);
+                    }
+                }
+            }
+
+            // handle_messages receives and handles messages, waiting until deadline, and returns false if there was no message
+            void start_thread(std::function<bool(timer::clock::time_point deadline)> handle_messages,
+                              const std::function<void()>&                           on_idle,
+                              const std::function<void()>&                           on_exit,
+                              const idle_policy&                                     idle,
+                              const thread_options&                                  options)
+            {
+                // subscribe before the thread runs, so that broadcast messages sent from now on are not missed
+                const auto cursor = msg_manager_.template get_channel<MessageType>().subscribe();
+
+                thread_ = std::thread([this, handle_messages, on_idle, on_exit, idle, options, cursor]
+                                      {
+                    auto pos = thread_name_.rfind("message_handler");
+                    if (pos != std::string::npos)
+                    {
+                        thread_name_ = thread_name_.substr(pos);
+                    }
+
+                    set_thread_name(thread_name_.c_str());
+                    if (!options.empty())
+                    {
+                        // before the handler allocates any memory, so that it is taken from its NUMA node
+                        const auto error = apply_thread_options(options);
+                        if (error && on_exception_)
+                        {
+                            on_exception_(std::system_error(error, "thread_options of " + thread_name_));
+                        }
+                    }
+                    msg_manager_.template get_channel<MessageType>().bind_consumer_thread(cursor);
+                    run(handle_messages, on_idle, idle);
+                    msg_manager_.template get_channel<MessageType>().unsubscribe(cursor);
+                    if (on_exit)
+                    {
+                        on_exit();
+                    } });
+            }
+
+        protected:
+            message_manager&                                     msg_manager_;
+            std::function<void(const std::exception& exception)> on_exception_;
+            std::string                                          thread_name_;
+            int                                                  demangling_status_{};
+            std::thread                                          thread_;
+
+            void run(const std::function<bool(timer::clock::time_point deadline)>& handle_messages,
+                     const std::function<void()>&                                 on_idle,
+                     const idle_policy&                                           idle)
+            {
+                const std::runtime_error unknown_exception("unknown exception");
+                const auto&              running    = msg_manager_.template get_channel<MessageType>().running;
+                std::size_t              idle_calls = 0; // since the last message
+
+                auto deadline = [](std::chrono::microseconds wait)
+                {
+                    if (wait == std::chrono::microseconds::max())
+                    {
+                        return timer::clock::time_point::max();
+                    }
+                    return wait.count() == 0 ? timer::clock::time_point::min() : timer::clock::now() + wait;
+                };
+
+                while (running)
+                {
+                    try
+                    {
+                        if (handle_messages(deadline(on_idle ? idle.next_wait(idle_calls) : std::chrono::microseconds::max())))
+                        {
+                            idle_calls = 0;
+                        }
+                        else if (running && on_idle && (idle.idle_mode != idle_policy::mode::once || idle_calls == 0))
+                        {
+                            ++idle_calls;
+                            on_idle();
+                        }
+                    }
+                    catch (const std::exception& ex)
+                    {
+                        if (on_exception_ && running)
+                        {
+                            on_exception_(ex);
+                        }
+                    }
+                    catch (...)
+                    {
+                        if (on_exception_ && running)
+                        {
+                            on_exception_(unknown_exception);
+                        }
+                    }
+                }
+            }
+        };
+
+        // Result of subscribe, receives every message of MessageType that is sent while it exists. It must not outlive the
+        // message_manager.
+        template <typename MessageType>
+        class subscription
+        {
+        public:
+            explicit subscription(message_manager& msg_manager)
+                : msg_manager_(msg_manager)
+                , cursor_(msg_manager.template get_channel<MessageType>().subscribe())
+            {
+            }
+
+            subscription(const subscription&)            = delete;
+            subscription& operator=(const subscription&) = delete;
+
+            ~subscription()
+            {
+                msg_manager_.template get_channel<MessageType>().unsubscribe(cursor_);
+            }
+
+            // like message_manager::receive_message, but each subscription receives the message
+            message_ptr<MessageType> receive(bool wait_for_message = false)
+            {
+                return receive_until(wait_for_message ? timer::clock::time_point::max() : timer::clock::time_point::min());
+            }
+
+            template <typename Rep, typename Period>
+            message_ptr<MessageType> receive_for(const std::chrono::duration<Rep, Period>& timeout)
+            {
+                return receive_until(timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout));
+            }
+
+        private:
+            message_ptr<MessageType> receive_until(timer::clock::time_point deadline)
+            {
+                element_type<MessageType> element;
+                if (!msg_manager_.template get_channel<MessageType>().pop(cursor_, element, deadline))
+                {
+                    return {};
+                }
+
+                if (msg_manager_.template has_logger<MessageType>())
+                {
+                    msg_manager_.template log<MessageType>(element, false);
+                }
+                return storage_policy<MessageType>::to_pointer(std::move(element));
+            }
+
+            message_manager&                          msg_manager_;
+            typename channel<MessageType>::subscriber cursor_;
+        };
+
+#ifdef CLIME_HAS_COROUTINES
+        // Result of async_receive. It registers itself as waiter of the channel, so a coroutine that waits for a
+        // message does not occupy a thread. As soon as a message may be available, it is received by a task of
+        // task_executor that resumes the coroutine.
+        template <typename MessageType>
+        class receive_awaitable : waiter
+        {
+            static_assert(!channel<MessageType>::broadcast, "broadcast messages are received with subscribe");
+            static_assert(!channel<MessageType>::shared, "coroutines cannot wait for messages in shared memory");
+            static_assert(!channel<MessageType>::journaled, "coroutines cannot acknowledge journaled messages");
+
+        public:
+            receive_awaitable(message_manager& msg_manager, executor& task_executor)
+                : msg_manager_(msg_manager)
+                , task_executor_(task_executor)
+            {
+                this->wake = &receive_awaitable::resume_later;
+            }
+
+            bool await_ready() { return received_ = msg_manager_.template get_channel<MessageType>().pop(element_, false); }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                auto&                       ch = msg_manager_.template get_channel<MessageType>();
+                std::lock_guard<std::mutex> lock(ch.mutex);
+                handle_           = handle;
+                const auto status = ch.pop_or_register(element_, *this);
+                if (status == channel<MessageType>::wait_status::waiting)
+                {
+                    ++ch.suspended_coroutines;
+                    return true;
+                }
+                received_ = status == channel<MessageType>::wait_status::done;
+                return false;
+            }
+
+            // an empty message_ptr if the channel was stopped, e.g. because the message_manager is disposed
+            message_ptr<MessageType> await_resume()
+            {
+                if (!received_)
+                {
+                    return {};
+                }
+                if (msg_manager_.template has_logger<MessageType>())
+                {
+                    msg_manager_.template log<MessageType>(element_, false);
+                }
+                return storage_policy<MessageType>::to_pointer(std::move(element_));
+            }
+
+        private:
+            static void resume_later(waiter& w) // called while holding the mutex of the channel
+            {
+                auto& self = static_cast<receive_awaitable&>(w);
+                self.task_executor_.submit([&self]
+                                           { self.retry(); });
+            }
+
+            void retry()
+            {
+                auto& ch = msg_manager_.template get_channel<MessageType>();
+                {
+                    std::lock_guard<std::mutex> lock(ch.mutex);
+                    const auto                  status = ch.pop_or_register(element_, *this);
+                    if (status == channel<MessageType>::wait_status::waiting)
+                    {
+                        return; // another consumer was faster
+                    }
+                    received_ = status == channel<MessageType>::wait_status::done;
+                }
+
+                handle_.resume(); // may destroy this awaitable
+                std::lock_guard<std::mutex> lock(ch.mutex);
+                --ch.suspended_coroutines;
+                ch.task_finished.notify_all();
+            }
+
+            message_manager&          msg_manager_;
+            executor&                 task_executor_;
+            std::coroutine_handle<>   handle_;
+            element_type<MessageType> element_;
+            bool                      received_{false};
+        };
+
+        // Result of async_send, suspends the coroutine while the queue of MessageType is full (see receive_awaitable).
+        template <typename MessageType>
+        class send_awaitable : waiter
+        {
+            static_assert(!channel<MessageType>::shared, "coroutines cannot wait for space in shared memory");
+
+        public:
+            send_awaitable(message_manager& msg_manager, element_type<MessageType> element, unsigned int max_queued_messages, executor& task_executor)
+                : msg_manager_(msg_manager)
+                , task_executor_(task_executor)
+                , element_(std::move(element))
+                , max_queued_messages_(max_queued_messages)
+            {
+                this->wake = &send_awaitable::resume_later;
+            }
+
+            bool await_ready()
+            {
+                if (msg_manager_.template has_logger<MessageType>())
+                {
+                    msg_manager_.template log<MessageType>(element_, true);
+                }
+
+                auto& ch = msg_manager_.template get_channel<MessageType>();
+                if (ch.overflow.load(std::memory_order_relaxed) != overflow_policy::block)
+                {
+                    sent_ = ch.push(element_, max_queued_messages_, timer::clock::time_point::min()); // never waits
+                    return true;
+                }
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                auto&                       ch = msg_manager_.template get_channel<MessageType>();
+                std::lock_guard<std::mutex> lock(ch.mutex);
+                handle_           = handle;
+                const auto status = ch.push_or_register(element_, max_queued_messages_, *this);
+                if (status == channel<MessageType>::wait_status::waiting)
+                {
+                    ++ch.suspended_coroutines;
+                    return true;
+                }
+                sent_ = status == channel<MessageType>::wait_status::done;
+                return false;
+            }
+
+            // false if the message was dropped
+            bool await_resume() const { return sent_; }
+
+        private:
+            static void resume_later(waiter& w) // called while holding the mutex of the channel
+            {
+                auto& self = static_cast<send_awaitable&>(w);
+                self.task_executor_.submit([&self]
+                                           { self.retry(); });
+            }
+
+            void retry()
+            {
+                auto& ch = msg_manager_.template get_channel<MessageType>();
+                {
+                    std::lock_guard<std::mutex> lock(ch.mutex);
+                    const auto                  status = ch.push_or_register(element_, max_queued_messages_, *this);
+                    if (status == channel<MessageType>::wait_status::waiting)
+                    {
+                        return; // another producer was faster
+                    }
+                    sent_ = status == channel<MessageType>::wait_status::done;
+                }
+
+                handle_.resume(); // may destroy this awaitable
+                std::lock_guard<std::mutex> lock(ch.mutex);
+                --ch.suspended_coroutines;
+                ch.task_finished.notify_all();
+            }
+
+            message_manager&          msg_manager_;
+            executor&                 task_executor_;
+            std::coroutine_handle<>   handle_;
+            element_type<MessageType> element_;
+            unsigned int              max_queued_messages_;
+            bool                      sent_{false};
+        };
+#endif
+
+    public:
+        message_manager()
+            : message_handler_(std::make_shared<std::tuple<std::list<std::shared_ptr<message_handler<MessageTypes>>>...>>())
+            , timer_([this]
+                     {
+                         if (draining_)
+                         {
+                             drained_.notify();
+                         }
+                     })
+            , log_writer_([this](const log_record& record)
+                          { write_log_record(record, std::index_sequence_for<MessageTypes...>()); })
+        {
+        }
+
+        virtual ~message_manager()
+        {
+            dispose();
+        }
+
+        void dispose()
+        {
+            static_cast<void>(shutdown_until(shutdown_mode::abort, timer::clock::time_point::min()));
+        }
+
+        // Like dispose, but returns the number of queued and delayed messages that were not received. With
+        // shutdown_mode::drain, it first waits without a timeout until the handlers have received all of them. Only
+        // message types that have a handler are waited for, other queued messages are not received.
+        std::size_t shutdown(shutdown_mode mode)
+        {
+            return shutdown_until(mode, timer::clock::time_point::max());
+        }
+
+        // Like shutdown above, but drains for timeout at most. Handlers that still handle a message are waited for.
+        template <typename Rep, typename Period>
+        std::size_t shutdown(shutdown_mode mode, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return shutdown_until(mode, timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout));
+        }
+
+        template <typename MessageType>
+        void clear_messages()
+        {
+            static_cast<void>(get_channel<MessageType>().clear());
+        }
+
+        // Removes the messages of a journaled queue (see journaled_queue_policy) that the calling thread has received
+        // with receive_message or receive_messages from the journal. Until then, they are received again after the next
+        // start. Handlers acknowledge each message when they have handled it without throwing.
+        template <typename MessageType>
+        void acknowledge()
+        {
+            static_assert(channel<MessageType>::journaled, "only journaled messages are acknowledged");
+            get_channel<MessageType>().acknowledge();
+        }
+
+#ifdef CLIME_HAS_JOURNAL
+        // Flushes the journal of MessageType to disk, e.g. after a batch of important messages.
+        template <typename MessageType>
+        void sync_journal()
+        {
+            static_assert(channel<MessageType>::journaled, "only journaled messages are written to disk");
+            get_channel<MessageType>().messages.sync();
+        }
+
+        // Returns the messages of MessageType whose handlers have thrown for all attempts of the journaled_queue_policy,
+        // also those of earlier runs. They are kept until the journal is removed with remove_journal.
+        template <typename MessageType>
+        std::vector<element_type<MessageType>> dead_letters()
+        {
+            static_assert(channel<MessageType>::journaled, "only journaled messages have dead letters");
+            return get_channel<MessageType>().messages.dead_letters();
+        }
+#endif
+
+        void clear_all_messages()
+        {
+            clear_all_messages_helper(std::index_sequence_for<MessageTypes...>());
+        }
+
+        template <typename MessageType>
+        std::size_t size() const
+        {
+            return get_channel<MessageType>().size();
+        }
+
+        std::size_t total_size() const
+        {
+            return total_size_helper(std::index_sequence_for<MessageTypes...>());
+        }
+
+#ifdef CLIME_ENABLE_STATS
+        // Returns the current statistics of MessageType. The counters are read without stopping any sender or receiver.
+        template <typename MessageType>
+        message_stats stats() const
+        {
+            const auto& ch = get_channel<MessageType>();
+            return ch.stats.snapshot(ch.size());
+        }
+#endif
+
+        template <typename MessageType>
+        void send_message(std::shared_ptr<MessageType> msg, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store(std::move(msg));
+            send_element<MessageType>(element, max_queued_messages);
+        }
+
+        template <typename MessageType>
+        void send_message(std::unique_ptr<MessageType> msg, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store(std::move(msg));
+            send_element<MessageType>(element, max_queued_messages);
+        }
+
+        // Sends a message by value, which is stored according to storage_policy<MessageType>.
+        template <typename MessageType, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        void send_message(MessageType msg, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store_value(std::move(msg));
+            send_element<MessageType>(element, max_queued_messages);
+        }
+
+        // Like send_message, but never waits: returns false and drops msg if the queue of MessageType is full.
+        template <typename MessageType>
+        bool try_send_message(std::shared_ptr<MessageType> msg, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store(std::move(msg));
+            return send_element<MessageType>(element, max_queued_messages, timer::clock::time_point::min());
+        }
+
+        template <typename MessageType>
+        bool try_send_message(std::unique_ptr<MessageType> msg, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store(std::move(msg));
+            return send_element<MessageType>(element, max_queued_messages, timer::clock::time_point::min());
+        }
+
+        template <typename MessageType, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        bool try_send_message(MessageType msg, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store_value(std::move(msg));
+            return send_element<MessageType>(element, max_queued_messages, timer::clock::time_point::min());
+        }
+
+        // Like send_message, but waits at most until time for space in the queue. Returns false and drops msg if the
+        // queue is still full.
+        template <typename MessageType, typename Clock, typename Duration>
+        bool try_send_message_until(std::shared_ptr<MessageType> msg, const std::chrono::time_point<Clock, Duration>& time, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store(std::move(msg));
+            return send_element<MessageType>(element, max_queued_messages, to_steady_time(time));
+        }
+
+        template <typename MessageType, typename Clock, typename Duration>
+        bool try_send_message_until(std::unique_ptr<MessageType> msg, const std::chrono::time_point<Clock, Duration>& time, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store(std::move(msg));
+            return send_element<MessageType>(element, max_queued_messages, to_steady_time(time));
+        }
+
+        template <typename MessageType, typename Clock, typename Duration, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        bool try_send_message_until(MessageType msg, const std::chrono::time_point<Clock, Duration>& time, unsigned int max_queued_messages = 0)
+        {
+            auto element = storage_policy<MessageType>::store_value(std::move(msg));
+            return send_element<MessageType>(element, max_queued_messages, to_steady_time(time));
+        }
+
+        template <typename MessageType, typename Rep, typename Period>
+        bool try_send_message_for(std::shared_ptr<MessageType> msg, const std::chrono::duration<Rep, Period>& timeout, unsigned int max_queued_messages = 0)
+        {
+            return try_send_message_until(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout), max_queued_messages);
+        }
+
+        template <typename MessageType, typename Rep, typename Period>
+        bool try_send_message_for(std::unique_ptr<MessageType> msg, const std::chrono::duration<Rep, Period>& timeout, unsigned int max_queued_messages = 0)
+        {
+            return try_send_message_until(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout), max_queued_messages);
+        }
+
+        template <typename MessageType, typename Rep, typename Period, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        bool try_send_message_for(MessageType msg, const std::chrono::duration<Rep, Period>& timeout, unsigned int max_queued_messages = 0)
+        {
+            return try_send_message_until(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout), max_queued_messages);
+        }
+
+        // Sets the maximum queue length of MessageType for messages that are sent with max_queued_messages 0 (0 means
+        // unlimited) and what happens to a message that is sent while the queue is full. Throws std::invalid_argument
+        // for overflow_policy::drop_oldest if the queue has a single consumer.
+        template <typename MessageType>
+        void set_capacity(std::size_t capacity, overflow_policy overflow = overflow_policy::block)
+        {
+            if (channel<MessageType>::single_consumer && overflow == overflow_policy::drop_oldest)
+            {
+                throw std::invalid_argument("overflow_policy::drop_oldest needs a queue that senders may pop from, spsc_ring may only be popped by its consumer");
+            }
+
+            auto& ch = get_channel<MessageType>();
+            ch.capacity.store(capacity, std::memory_order_relaxed);
+            ch.overflow.store(overflow, std::memory_order_relaxed);
+        }
+
+        // Sends all messages in [first, last) with a single lock acquisition (unless it needs to wait for
+        // max_queued_messages). The elements need to be convertible to element_type<MessageType>.
+        template <typename MessageType, typename ForwardIt>
+        void send_messages(ForwardIt first, ForwardIt last, unsigned int max_queued_messages = 0)
+        {
+            if (!has_logger<MessageType>())
+            {
+                get_channel<MessageType>().push_batch(first, last, max_queued_messages);
+            }
+            else if constexpr (std::is_copy_constructible<element_type<MessageType>>::value)
+            {
+                get_channel<MessageType>().push_batch(first, last, max_queued_messages);
+                for (; first != last; ++first)
+                {
+                    log<MessageType>(*first, true);
+                }
+            }
+            else
+            {
+                // the elements are moved into the queue, so they need to be logged before
+                for (auto it = first; it != last; ++it)
+                {
+                    log<MessageType>(*it, true);
+                }
+                get_channel<MessageType>().push_batch(first, last, max_queued_messages);
+            }
+        }
+
+        // Sends msg after delay_duration. The returned handle can be used to cancel sending.
+        template <typename MessageType, typename Rep, typename Period>
+        timer::handle send_message(std::shared_ptr<MessageType> msg, const std::chrono::duration<Rep, Period>& delay_duration)
+        {
+            return send_message_at(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(delay_duration));
+        }
+
+        // Sends msg at time. The returned handle can be used to cancel sending.
+        template <typename MessageType, typename Clock, typename Duration>
+        timer::handle send_message_at(std::shared_ptr<MessageType> msg, const std::chrono::time_point<Clock, Duration>& time)
+        {
+            return schedule_element<MessageType>(storage_policy<MessageType>::store(std::move(msg)), to_steady_time(time));
+        }
+
+        template <typename MessageType, typename Rep, typename Period>
+        timer::handle send_message(std::unique_ptr<MessageType> msg, const std::chrono::duration<Rep, Period>& delay_duration)
+        {
+            return send_message_at(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(delay_duration));
+        }
+
+        template <typename MessageType, typename Clock, typename Duration>
+        timer::handle send_message_at(std::unique_ptr<MessageType> msg, const std::chrono::time_point<Clock, Duration>& time)
+        {
+            return schedule_element<MessageType>(storage_policy<MessageType>::store(std::move(msg)), to_steady_time(time));
+        }
+
+        template <typename MessageType, typename Rep, typename Period, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        timer::handle send_message(MessageType msg, const std::chrono::duration<Rep, Period>& delay_duration)
+        {
+            return send_message_at(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(delay_duration));
+        }
+
+        template <typename MessageType, typename Clock, typename Duration, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        timer::handle send_message_at(MessageType msg, const std::chrono::time_point<Clock, Duration>& time)
+        {
+            return schedule_element<MessageType>(storage_policy<MessageType>::store_value(std::move(msg)), to_steady_time(time));
+        }
+
+        // Sends msg as clime::call<Request, Reply> to its handler, which answers it with call::reply, e.g. one that was added
+        // with add_responder. The caller waits in a preallocated slot of the channel for the reply, so a round trip needs
+        // neither a thread nor a message_manager of its own. The returned pending_reply is empty if it has not been
+        // answered after timeout, which is scheduled on the timer, or if all slots of the call are in use.
+        template <typename Request, typename Reply, typename Rep, typename Period>
+        auto request(Request msg, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return request_until<Request, Reply>(std::move(msg), timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout));
+        }
+
+        // Like request above, but waits for the reply until the message_manager is disposed.
+        template <typename Request, typename Reply>
+        auto request(Request msg)
+        {
+            return request_until<Request, Reply>(std::move(msg), timer::clock::time_point::max());
+        }
+
+        template <typename MessageType>
+        message_ptr<MessageType> receive_message(bool wait_for_message = false)
+        {
+            static_assert(!channel<MessageType>::broadcast, "broadcast messages are received with subscribe");
+
+            element_type<MessageType> element;
+            if (!receive_element<MessageType>(element, wait_for_message))
+            {
+                return {};
+            }
+            return storage_policy<MessageType>::to_pointer(std::move(element));
+        }
+
+        // Waits up to timeout for a message of type MessageType and returns an empty message_ptr if none arrived.
+        template <typename MessageType, typename Rep, typename Period>
+        message_ptr<MessageType> receive_message_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            static_assert(!channel<MessageType>::broadcast, "broadcast messages are received with subscribe");
+
+            element_type<MessageType> element;
+            if (!receive_element<MessageType>(element, timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout)))
+            {
+                return {};
+            }
+            return storage_policy<MessageType>::to_pointer(std::move(element));
+        }
+
+        // Waits up to timeout until a message of any of MessageTypes... arrives, like select of the go language, e.g.
+        // auto msg = receive_any<my_message, my_other_message>(std::chrono::seconds(1));
+        // The result holds the received message_ptr or std::monostate if there was no message in time.
+        template <typename... Types, typename Rep, typename Period>
+        std::variant<std::monostate, message_ptr<Types>...> receive_any(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return receive_any_until<Types...>(timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(timeout),
+                                               std::index_sequence_for<Types...>());
+        }
+
+        // Like receive_any above, but waits until there is a message (or the message_manager is disposed).
+        template <typename... Types>
+        std::variant<std::monostate, message_ptr<Types>...> receive_any()
+        {
+            return receive_any_until<Types...>(timer::clock::time_point::max(), std::index_sequence_for<Types...>());
+        }
+
+        // Returns a subscription that receives every message of MessageType sent from now on, while other subscriptions
+        // and all handlers of MessageType receive the same messages. MessageType needs a broadcast queue, e.g.
+        // template <> struct clime::queue_policy<my_event> : clime::broadcast_queue_policy<1024> {};
+        template <typename MessageType>
+        subscription<MessageType> subscribe()
+        {
+            static_assert(channel<MessageType>::broadcast, "subscribe needs a message type with a broadcast_queue_policy");
+            return subscription<MessageType>(*this);
+        }
+
+        // Writes up to max_count messages of type element_type<MessageType> to out with a single lock acquisition and
+        // returns the number of received messages. If wait_for_message is true, it waits for at least one message.
+        template <typename MessageType, typename OutputIt>
+        std::size_t receive_messages(OutputIt out, std::size_t max_count, bool wait_for_message = false)
+        {
+            return receive_messages<MessageType>(out, max_count, wait_for_message ? timer::clock::time_point::max() : timer::clock::time_point::min());
+        }
+
+        // Like receive_messages above, but waits until deadline for at least one message.
+        template <typename MessageType, typename OutputIt>
+        std::size_t receive_messages(OutputIt out, std::size_t max_count, timer::clock::time_point deadline)
+        {
+            static_assert(!channel<MessageType>::broadcast, "broadcast messages are received with subscribe");
+            return receive_elements<MessageType>(out, max_count, deadline);
+        }
+
+        // Sets a function that is called whenever a message of MessageType is sent or received, in the thread that sends or
+        // receives it. It may be replaced at any time, nullptr removes it.
+        template <typename MessageType>
+        void set_logger(logger_type<MessageType> logger)
+        {
+            static_assert(channel<MessageType>::logging, "feature_policy of this message type has no_logging");
+            std::get<logger_slot<logger_type<MessageType>>>(logger_).store(std::move(logger));
+        }
+
+        // Like set_logger, but the logger is called by a background thread, so that sending and receiving only pays for
+        // passing a log record to it. Messages that are not stored as std::shared_ptr are copied for the logger.
+        template <typename MessageType>
+        void set_async_logger(async_logger_type<MessageType> logger)
+        {
+            static_assert(std::is_same<element_type<MessageType>, std::shared_ptr<MessageType>>::value || std::is_copy_constructible<MessageType>::value,
+                          "asynchronous loggers need messages that are shared or can be copied");
+            static_assert(channel<MessageType>::logging, "feature_policy of this message type has no_logging");
+
+            std::get<logger_slot<async_logger_type<MessageType>>>(async_logger_).store(std::move(logger));
+        }
+
+        // number of log records that were dropped because the asynchronous loggers did not keep up
+        std::uint64_t dropped_log_records() const
+        {
+            return log_writer_.dropped();
+        }
+
+        // number of delayed messages that were dropped because the queue of their type was full when they were due
+        std::uint64_t dropped_delayed_messages() const
+        {
+            return dropped_delayed_.load(std::memory_order_relaxed);
+        }
+
+#ifdef CLIME_HAS_COROUTINES
+        // co_await async_receive<MessageType>() suspends the coroutine until a message has arrived and resumes it on a
+        // thread of task_executor. It returns an empty message_ptr if the message_manager is disposed meanwhile.
+        template <typename MessageType>
+        receive_awaitable<MessageType> async_receive(executor& task_executor = executor::default_executor())
+        {
+            return receive_awaitable<MessageType>(*this, task_executor);
+        }
+
+        // co_await async_send(msg) suspends the coroutine while the queue is full (see send_message) and resumes it on
+        // a thread of task_executor. It returns false if the message was dropped (see set_capacity).
+        template <typename MessageType>
+        send_awaitable<MessageType> async_send(std::shared_ptr<MessageType> msg,
+                                               unsigned int                 max_queued_messages = 0,
+                                               executor&                    task_executor       = executor::default_executor())
+        {
+            return send_awaitable<MessageType>(*this, storage_policy<MessageType>::store(std::move(msg)), max_queued_messages, task_executor);
+        }
+
+        template <typename MessageType, typename = std::enable_if_t<is_message_type<MessageType>::value>>
+        send_awaitable<MessageType> async_send(MessageType msg,
+                                               unsigned int max_queued_messages = 0,
+                                               executor&    task_executor       = executor::default_executor())
+        {
+            return send_awaitable<MessageType>(*this, storage_policy<MessageType>::store_value(std::move(msg)), max_queued_messages, task_executor);
+        }
+#endif
+
+        // Creates a message whose memory is taken from a pool of MessageType and returned to it as soon as the last
+        // std::shared_ptr to the message is released, e.g. after the message handler has finished. In steady state,
+        // sending such messages does not allocate heap memory (if MessageType uses a ring queue, see queue_policy).
+        template <typename MessageType, typename... Args>
+        std::shared_ptr<MessageType> acquire(Args&&... args)
+        {
+            static_assert(std::is_base_of<shared_storage, storage_policy<MessageType>>::value, "only messages stored as std::shared_ptr can be pooled");
+            return std::allocate_shared<MessageType>(pool_allocator<MessageType>(get_channel<MessageType>().pool), std::forward<Args>(args)...);
+        }
+
+        template <typename MessageType>
+        void add_handler(
+            std::function<void(element_type<MessageType> message_type)> on_message,
+            std::function<void(const std::exception& exception)>        on_exception = nullptr,
+            std::function<void()>                                       on_idle      = nullptr,
+            std::function<void()>                                       on_exit      = nullptr,
+            const std::string&                                          thread_name  = "",
+            const idle_policy&                                          idle         = idle_policy::poll(),
+            const thread_options&                                       thread       = {})
+        {
+            const std::size_t consumer     = add_consumer<MessageType>();
+            auto&             handler_time = get_channel<MessageType>().stats.add_handler();
+            start_handler<MessageType>([this, on_message, consumer, &handler_time](timer::clock::time_point deadline)
+                                       {
+                                           element_type<MessageType> incoming_message;
+                                           if (!receive_element<MessageType>(incoming_message, deadline, consumer))
+                                           {
+                                               return false;
+                                           }
+
+                                           auto& ch = get_channel<MessageType>();
+                                           if (ch.running || draining_)
+                                           {
+                                               const auto started = ch.stats.now();
+                                               ch.handle_received([&]
+                                                                  { on_message(std::move(incoming_message)); });
+                                               ch.stats.on_handled(handler_time, started);
+                                           }
+                                           else
+                                           {
+                                               ch.abandon();
+                                           }
+                                           return true; },
+                                       on_exception,
+                                       on_idle,
+                                       on_exit,
+                                       thread_name,
+                                       idle,
+                                       thread);
+        }
+
+        // Adds a handler that either has its own thread or, if options.task_executor is set, runs as a task of an executor.
+        // Handlers that run as tasks only occupy a thread while there are messages, several handlers of the same message
+        // type may run in parallel, and each one handles its messages in the order of the queue.
+        template <typename MessageType>
+        void add_handler(std::function<void(element_type<MessageType> message_type)> on_message, const handler_options& options)
+        {
+            // handlers of shared memory queues wait for other processes, which cannot schedule a task
+            if (options.task_executor == nullptr || channel<MessageType>::shared)
+            {
+                add_handler<MessageType>(std::move(on_message), options.on_exception, options.on_idle, options.on_exit, options.thread_name, options.idle, options.thread);
+                return;
+            }
+
+            auto& ch                = get_channel<MessageType>();
+            auto& consumer          = ch.add_task_consumer();
+            consumer.on_message     = std::move(on_message);
+            consumer.on_exception   = options.on_exception;
+            consumer.on_exit        = options.on_exit;
+            consumer.task_executor  = options.task_executor;
+            consumer.handler_time   = &ch.stats.add_handler();
+            consumer.task           = [this, &consumer]
+            { run_task_consumer<MessageType>(consumer); };
+            ch.start_task_consumer(consumer);
+        }
+
+        // Adds a handler that answers each request sent with request<Request, Reply> with the result of responder. If
+        // responder throws, the exception is rethrown by pending_reply::get instead of being passed to on_exception.
+        template <typename Request, typename Reply>
+        void add_responder(std::function<Reply(const Request& request)> responder, const handler_options& options = {})
+        {
+            static_assert(call_index<Request, Reply>() < sizeof...(MessageTypes), "add_responder needs clime::call<Request, Reply> as message type");
+            using call_message = call_type<Request, Reply>;
+
+            add_handler<call_message>([responder](element_type<call_message> element)
+                                      {
+                                          const auto& incoming_call = message_of(element);
+                                          try
+                                          {
+                                              incoming_call.reply(responder(incoming_call.request));
+                                          }
+                                          catch (...)
+                                          {
+                                              incoming_call.fail(std::current_exception());
+                                          } },
+                                      options);
+        }
+
+        // Like add_handler, but the handler receives up to max_batch_size messages at once.
+        template <typename MessageType>
+        void add_batch_handler(
+            std::function<void(span<element_type<MessageType>> message_types)> on_messages,
+            std::size_t                                                        max_batch_size = 64,
+            std::function<void(const std::exception& exception)>               on_exception   = nullptr,
+            std::function<void()>                                              on_idle        = nullptr,
+            std::function<void()>                                              on_exit        = nullptr,
+            const std::string&                                                 thread_name    = "",
+            const idle_policy&                                                 idle           = idle_policy::poll(),
+            const thread_options&                                              thread         = {})
+        {
+            auto buffer = std::make_shared<std::vector<element_type<MessageType>>>();
+            buffer->reserve(max_batch_size);
+
+            const std::size_t consumer     = add_consumer<MessageType>();
+            auto&             handler_time = get_channel<MessageType>().stats.add_handler();
+            start_handler<MessageType>([this, on_messages, max_batch_size, buffer, consumer, &handler_time](timer::clock::time_point deadline)
+                                       {
+                                           buffer->clear();
+                                           if (receive_elements<MessageType>(std::back_inserter(*buffer), max_batch_size, deadline, consumer) == 0)
+                                           {
+                                               return false;
+                                           }
+
+                                           auto& ch = get_channel<MessageType>();
+                                           if (ch.running || draining_)
+                                           {
+                                               const auto started = ch.stats.now();
+                                               ch.handle_received([&]
+                                                                  { on_messages(span<element_type<MessageType>>(buffer->data(), buffer->size())); });
+                                               ch.stats.on_handled(handler_time, started);
+                                           }
+                                           else
+                                           {
+                                               ch.abandon();
+                                           }
+                                           return true; },
+                                       on_exception,
+                                       on_idle,
+                                       on_exit,
+                                       thread_name,
+                                       idle,
+                                       thread);
+        }
+
+        template <typename MessageType>
+        void clear_handlers()
+        {
+            using HandlerListType                 = std::list<std::shared_ptr<message_handler<MessageType>>>;
+            HandlerListType& message_handler_list = std::get<HandlerListType>(*message_handler_);
+            message_handler_list.clear(); // ends all message_handler threads that handled MessageType
+
+            get_channel<MessageType>().stop();
+            get_channel<MessageType>().remove_task_consumers();
+            get_channel<MessageType>().remove_consumers();
+            get_channel<MessageType>().stats.remove_handlers();
+
+            if (running_)
+            {
+                // the destroyed handlers stopped the channel of MessageType, so it can be used again by new handlers
+                auto&                       ch = get_channel<MessageType>();
+                std::lock_guard<std::mutex> lock(ch.mutex);
+                ch.running = true;
+            }
+        }
+
+        void clear_all_loggers()
+        {
+            clear_logger_helper(std::index_sequence_for<MessageTypes...>());
+        }
+
+    protected:
+        std::tuple<channel<MessageTypes>...>                                                      channels_;
+        std::tuple<logger_slot<logger_type<MessageTypes>>...>                                     logger_;
+        std::tuple<logger_slot<async_logger_type<MessageTypes>>...>                               async_logger_;
+        std::shared_ptr<std::tuple<std::list<std::shared_ptr<message_handler<MessageTypes>>>...>> message_handler_;
+        std::atomic<bool>                                                                         running_{true};
+        std::atomic<bool>                                                                         draining_{false}; // handlers deliver received messages after they were stopped
+        drain_signal                                                                              drained_;
+        timer                                                                                     timer_;
+        log_writer                                                                                log_writer_;
+        std::atomic<std::uint64_t>                                                                dropped_delayed_{0}; // see dropped_delayed_messages
+
+    private:
+        // shared by the waiters that receive_any registers in the channels of all its message types
+        struct select_state
+        {
+            std::mutex              mutex;
+            std::condition_variable cv;
+            bool                    woken{false};
+        };
+
+        struct select_waiter : waiter
+        {
+            select_state* state{nullptr};
+
+            static void wake_select(waiter& w) // called while holding the mutex of the channel
+            {
+                auto&                       state = *static_cast<select_waiter&>(w).state;
+                std::lock_guard<std::mutex> lock(state.mutex);
+                state.woken = true;
+                state.cv.notify_one();
+            }
+        };
+
+        template <typename... Types, std::size_t... Is>
+        std::variant<std::monostate, message_ptr<Types>...> receive_any_until(timer::clock::time_point deadline, std::index_sequence<Is...>)
+        {
+            static_assert(sizeof...(Types) > 0 && (is_message_type<Types>::value && ...), "receive_any needs message types of this message_manager");
+            static_assert(!(channel<Types>::broadcast || ...), "broadcast messages are received with subscribe");
+            static_assert(!(channel<Types>::shared || ...), "receive_any cannot wait for messages in shared memory");
+            static_assert(!(channel<Types>::journaled || ...), "receive_any cannot acknowledge journaled messages");
+
+            constexpr std::size_t                               count = sizeof...(Types);
+            std::variant<std::monostate, message_ptr<Types>...> result;
+            select_state                                        state;
+            std::array<select_waiter, count>                    waiters;
+            for (auto& w : waiters)
+            {
+                w.state = &state;
+                w.wake  = &select_waiter::wake_select;
+            }
+
+            // start with another message type on each call, so that no type starves the others
+            thread_local std::size_t rotation = 0;
+            const std::size_t        first    = rotation++ % count;
+
+            // registers the waiters one after another until a message was received, returns false if waiting is necessary
+            auto try_receive = [&]
+            {
+                std::size_t stopped  = 0;
+                bool        received = false;
+                for (std::size_t n = 0; n < count && !received; ++n)
+                {
+                    const std::size_t i = (first + n) % count;
+                    static_cast<void>(((Is == i && (received = select_one<Is, Types>(waiters[Is], stopped, result))) || ...));
+                }
+                return received || stopped == count;
+            };
+
+            for (;;)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(state.mutex);
+                    state.woken = false;
+                }
+
+                if (try_receive())
+                {
+                    break;
+                }
+
+                bool timed_out = false;
+                {
+                    std::unique_lock<std::mutex> lock(state.mutex);
+                    auto                         woken = [&]
+                    { return state.woken; };
+
+                    if (deadline == timer::clock::time_point::max())
+                    {
+                        state.cv.wait(lock, woken);
+                    }
+                    else
+                    {
+                        timed_out = !state.cv.wait_until(lock, deadline, woken);
+                    }
+                }
+
+                (unregister_select<Types>(waiters[Is], false), ...);
+                if (timed_out)
+                {
+                    break;
+                }
+            }
+
+            // a waiter that was notified, but did not receive a message, passes the notification on to other consumers
+            (unregister_select<Types>(waiters[Is], result.index() != Is + 1), ...);
+            return result;
+        }
+
+        // Tries to receive a message of MessageType for receive_any and registers w if there is none.
+        template <std::size_t I, typename MessageType, typename Result>
+        bool select_one(select_waiter& w, std::size_t& stopped, Result& result)
+        {
+            auto&                     ch = get_channel<MessageType>();
+            element_type<MessageType> element;
+            {
+                std::lock_guard<std::mutex> lock(ch.mutex);
+                const auto                  status = ch.pop_or_register(element, w);
+                if (status != channel<MessageType>::wait_status::done)
+                {
+                    stopped += status == channel<MessageType>::wait_status::stopped ? 1 : 0;
+                    return false;
+                }
+            }
+
+            if (has_logger<MessageType>())
+            {
+                log<MessageType>(element, false);
+            }
+            result.template emplace<I + 1>(storage_policy<MessageType>::to_pointer(std::move(element)));
+            return true;
+        }
+
+        template <typename MessageType>
+        void unregister_select(select_waiter& w, bool pass_on)
+        {
+            auto&                       ch = get_channel<MessageType>();
+            std::lock_guard<std::mutex> lock(ch.mutex);
+            if (w.linked)
+            {
+                ch.consumers.remove(w);
+            }
+            else if (pass_on && w.notified)
+            {
+                w.notified = false;
+                ch.pass_on_notification();
+            }
+        }
+
+        template <typename MessageType>
+        bool send_element(element_type<MessageType>& element,
+                          unsigned int               max_queued_messages,
+                          timer::clock::time_point   deadline = timer::clock::time_point::max())
+        {
+            if (!has_logger<MessageType>())
+            {
+                return get_channel<MessageType>().push(element, max_queued_messages, deadline); // moves element into the queue
+            }
+            else if constexpr (std::is_copy_constructible<element_type<MessageType>>::value)
+            {
+                auto logged_element = element;
+                if (!get_channel<MessageType>().push(element, max_queued_messages, deadline))
+                {
+                    return false;
+                }
+                log<MessageType>(logged_element, true);
+                return true;
+            }
+            else
+            {
+                log<MessageType>(element, true); // a move-only element is owned by the receiver as soon as it is in the queue
+                return get_channel<MessageType>().push(element, max_queued_messages, deadline);
+            }
+        }
+
+        // Moves the stored element into a timer entry, which sends it at time. The timer keeps std::function, which must
+        // be copyable, so an element that can only be moved, e.g. with unique_storage, is moved into a shared box.
+        template <typename MessageType>
+        timer::handle schedule_element(element_type<MessageType> element, timer::clock::time_point time)
+        {
+            if constexpr (std::is_copy_constructible<element_type<MessageType>>::value)
+            {
+                return timer_.schedule(time, [this, element = std::move(element)]() mutable
+                                       { send_delayed<MessageType>(element); });
+            }
+            else
+            {
+                auto box = std::make_shared<element_type<MessageType>>(std::move(element));
+                return timer_.schedule(time, [this, box]
+                                       { send_delayed<MessageType>(*box); });
+            }
+        }
+
+        // Called by the timer thread, which must not wait for space in a full queue, because it would delay all other
+        // delayed messages and request timeouts. So the overflow policy of a full queue is applied as by try_send_message.
+        template <typename MessageType>
+        void send_delayed(element_type<MessageType>& element)
+        {
+            if (!send_element<MessageType>(element, 0, timer::clock::time_point::min()))
+            {
+                dropped_delayed_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        template <typename Clock, typename Duration>
+        static timer::clock::time_point to_steady_time(const std::chrono::time_point<Clock, Duration>& time)
+        {
+            if constexpr (std::is_same<Clock, timer::clock>::value)
+            {
+                return std::chrono::time_point_cast<timer::clock::duration>(time);
+            }
+            else
+            {
+                return timer::clock::now() + std::chrono::duration_cast<timer::clock::duration>(time - Clock::now());
+            }
+        }
+
+        // the number of a new handler of an affine queue, see channel::add_consumer
+        template <typename MessageType>
+        std::size_t add_consumer()
+        {
+            auto&                       ch = get_channel<MessageType>();
+            std::lock_guard<std::mutex> lock(ch.mutex);
+            return ch.add_consumer();
+        }
+
+        // receive_messages for handlers, which also receive broadcast messages (with the cursor of their thread) and
+        // the messages of the shards of consumer
+        template <typename MessageType, typename OutputIt>
+        std::size_t receive_elements(OutputIt out, std::size_t max_count, timer::clock::time_point deadline, std::size_t consumer = channel<MessageType>::no_consumer)
+        {
+            using ElementType = element_type<MessageType>;
+
+            if (!has_logger<MessageType>())
+            {
+                return get_channel<MessageType>().pop_batch([&](ElementType& element)
+                                                            { *out++ = std::move(element); },
+                                                            max_count,
+                                                            deadline,
+                                                            consumer);
+            }
+
+            // the logger must not be called while the channel is locked
+            std::vector<ElementType> received;
+            received.reserve(max_count < 64 ? max_count : 64);
+            get_channel<MessageType>().pop_batch([&](ElementType& element)
+                                                 { received.push_back(std::move(element)); },
+                                                 max_count,
+                                                 deadline,
+                                                 consumer);
+
+            for (auto& element : received)
+            {
+                log<MessageType>(element, false);
+                *out++ = std::move(element);
+            }
+
+            return received.size();
+        }
+
+        template <typename MessageType>
+        bool receive_element(element_type<MessageType>& element, bool wait_for_message)
+        {
+            return receive_element<MessageType>(element, wait_for_message ? timer::clock::time_point::max() : timer::clock::time_point::min());
+        }
+
+        template <typename MessageType>
+        bool receive_element(element_type<MessageType>& element, timer::clock::time_point deadline, std::size_t consumer = channel<MessageType>::no_consumer)
+        {
+            if (!get_channel<MessageType>().pop(element, deadline, consumer))
+            {
+                return false;
+            }
+
+            if (has_logger<MessageType>())
+            {
+                log<MessageType>(element, false);
+            }
+            return true;
+        }
+
+        template <typename MessageType>
+        channel<MessageType>& get_channel()
+        {
+            return std::get<channel<MessageType>>(channels_);
+        }
+
+        template <typename MessageType>
+        const channel<MessageType>& get_channel() const
+        {
+            return std::get<channel<MessageType>>(channels_);
+        }
+
+        template <typename MessageType>
+        void start_handler(std::function<bool(timer::clock::time_point deadline)> handle_messages,
+                           std::function<void(const std::exception& exception)>   on_exception,
+                           std::function<void()>                                  on_idle,
+                           std::function<void()>                                  on_exit,
+                           const std::string&                                     thread_name,
+                           const idle_policy&                                     idle,
+                           const thread_options&                                  thread)
+        {
+            using HandlerListType                 = std::list<std::shared_ptr<message_handler<MessageType>>>;
+            HandlerListType& message_handler_list = std::get<HandlerListType>(*message_handler_);
+            message_handler_list.emplace_back(std::make_shared<message_handler<MessageType>>(*this, on_exception, thread_name));
+            message_handler_list.back()->start_thread(handle_messages, on_idle, on_exit, idle, thread);
+        }
+
+        template <typename MessageType>
+        void run_task_consumer(typename channel<MessageType>::task_consumer& consumer)
+        {
+            constexpr std::size_t    max_messages_per_task = 64; // then other tasks of the executor get their turn
+            const std::runtime_error unknown_exception("unknown exception");
+            auto&                    ch = get_channel<MessageType>();
+            ch.bind_task_consumer(consumer);
+
+            for (std::size_t i = 0; i < max_messages_per_task;)
+            {
+                element_type<MessageType> incoming_message;
+                if (!ch.running || !receive_element<MessageType>(incoming_message, timer::clock::time_point::min(), consumer.consumer))
+                {
+                    if (ch.finish_task(consumer))
+                    {
+                        return;
+                    }
+                    continue;
+                }
+
+                try
+                {
+                    if (ch.running || draining_)
+                    {
+                        const auto started = ch.stats.now();
+                        ch.handle_received([&]
+                                           { consumer.on_message(std::move(incoming_message)); });
+                        ch.stats.on_handled(*consumer.handler_time, started);
+                    }
+                    else
+                    {
+                        ch.abandon();
+                    }
+                }
+                catch (const std::exception& ex)
+                {
+                    if (consumer.on_exception && ch.running)
+                    {
+                        consumer.on_exception(ex);
+                    }
+                }
+                catch (...)
+                {
+                    if (consumer.on_exception && ch.running)
+                    {
+                        consumer.on_exception(unknown_exception);
+                    }
+                }
+                ++i;
+            }
+
+            consumer.task_executor->submit(consumer.task);
+        }
+
+        template <std::size_t... Is>
+        void stop_all_channels(std::index_sequence<Is...>)
+        {
+            (get_channel<MessageTypes>().stop(), ...);
+        }
+
+        template <std::size_t... Is>
+        void remove_all_task_consumers(std::index_sequence<Is...>)
+        {
+            (get_channel<MessageTypes>().remove_task_consumers(), ...);
+        }
+
+        template <std::size_t... Is>
+        void clear_all_messages_helper(std::index_sequence<Is...>)
+        {
+            (clear_messages<MessageTypes>(), ...);
+        }
+
+        // Stops everything that runs in the background. All channels are stopped, which wakes all their waiters at
+        // once, before the first handler thread is joined, so the handler threads finish in parallel.
+        std::size_t shutdown_until(shutdown_mode mode, timer::clock::time_point deadline)
+        {
+            if (mode == shutdown_mode::drain && running_)
+            {
+                draining_ = true; // a message that a handler has received, but not handled yet, is delivered as well
+                set_drain_signal(&drained_, std::index_sequence_for<MessageTypes...>());
+                for (;;)
+                {
+                    std::uint64_t generation = 0;
+                    {
+                        std::lock_guard<std::mutex> lock(drained_.mutex);
+                        generation = drained_.generation;
+                    }
+                    if (handled_size(std::index_sequence_for<MessageTypes...>()) == 0 && timer_.pending() == 0)
+                    {
+                        break;
+                    }
+
+                    std::unique_lock<std::mutex> lock(drained_.mutex);
+                    auto                         notified = [&]
+                    { return drained_.generation != generation; };
+                    if (deadline == timer::clock::time_point::max())
+                    {
+                        drained_.cv.wait(lock, notified);
+                    }
+                    else if (!drained_.cv.wait_until(lock, deadline, notified))
+                    {
+                        break;
+                    }
+                }
+                set_drain_signal(nullptr, std::index_sequence_for<MessageTypes...>());
+            }
+
+            log_writer_.stop(); // asynchronous loggers get all records written so far
+            clear_all_loggers();
+            std::size_t undelivered = clear_process_messages(std::index_sequence_for<MessageTypes...>());
+            running_                = false;
+            stop_all_channels(std::index_sequence_for<MessageTypes...>());
+            undelivered += timer_.stop(); // discards all delayed messages
+            expire_all_replies(std::index_sequence_for<MessageTypes...>());
+            message_handler_.reset();
+            remove_all_task_consumers(std::index_sequence_for<MessageTypes...>());
+            draining_ = false;
+            return undelivered;
+        }
+
+        template <typename Request, typename Reply>
+        auto request_until(Request msg, timer::clock::time_point deadline)
+        {
+            static_assert(call_index<Request, Reply>() < sizeof...(MessageTypes), "request needs clime::call<Request, Reply> as message type");
+            using call_message = call_type<Request, Reply>;
+            using reply_type   = pending_reply<Reply, call_message::slots>;
+
+            static_assert(!channel<call_message>::shared && !channel<call_message>::journaled, "calls cannot be passed in shared memory or a journal");
+
+            auto&                                     table = get_channel<call_message>().replies;
+            typename call_message::table_type::ticket ticket;
+            if (!running_ || !table.acquire(ticket))
+            {
+                return reply_type();
+            }
+
+            reply_type reply(&table, ticket);
+            if (deadline != timer::clock::time_point::max())
+            {
+                table.set_timeout(ticket, timer_.schedule(deadline, [&table, ticket]
+                                                          { table.expire(ticket); }));
+            }
+            send_message(call_message(std::move(msg), &table, ticket));
+            return reply;
+        }
+
+        // wakes callers that still wait for replies of a disposed message_manager
+        template <std::size_t... Is>
+        void expire_all_replies(std::index_sequence<Is...>)
+        {
+            (static_cast<void>(get_channel<MessageTypes>().replies.expire_all()), ...);
+        }
+
+        // messages in shared memory are kept for the other processes, journaled messages for the next start
+        template <std::size_t... Is>
+        std::size_t clear_process_messages(std::index_sequence<Is...>)
+        {
+            return ((channel<MessageTypes>::shared || channel<MessageTypes>::journaled ? 0 : get_channel<MessageTypes>().clear()) + ...);
+        }
+
+        // the queued messages that handlers would receive while shutdown drains, messages in shared memory are left to
+        // the other processes and messages without a handler would never be received
+        template <std::size_t... Is>
+        std::size_t handled_size(std::index_sequence<Is...>) const
+        {
+            return ((channel<MessageTypes>::shared || !has_handlers<MessageTypes>() ? 0 : size<MessageTypes>()) + ...);
+        }
+
+        template <typename MessageType>
+        bool has_handlers() const
+        {
+            using HandlerListType = std::list<std::shared_ptr<message_handler<MessageType>>>;
+            const auto&                 ch = get_channel<MessageType>();
+            std::lock_guard<std::mutex> lock(ch.mutex);
+            return !std::get<HandlerListType>(*message_handler_).empty() || !ch.task_consumers.empty();
+        }
+
+        template <std::size_t... Is>
+        void set_drain_signal(drain_signal* signal, std::index_sequence<Is...>)
+        {
+            (get_channel<MessageTypes>().drain.store(signal, std::memory_order_release), ...);
+        }
+
+        template <std::size_t... Is>
+        void clear_logger_helper(std::index_sequence<Is...>)
+        {
+            (clear_logger<MessageTypes>(), ...);
+        }
+
+        template <typename MessageType>
+        void clear_logger()
+        {
+            std::get<logger_slot<logger_type<MessageType>>>(logger_).store(nullptr);
+            std::get<logger_slot<async_logger_type<MessageType>>>(async_logger_).store(nullptr);
+        }
+
+        template <typename MessageType>
+        bool has_logger() const
+        {
+            if constexpr (!channel<MessageType>::logging)
+            {
+                return false;
+            }
+            else
+            {
+                return std::get<logger_slot<logger_type<MessageType>>>(logger_).is_set() ||
+                       std::get<logger_slot<async_logger_type<MessageType>>>(async_logger_).is_set();
+            }
+        }
+
+        // calls the logger of MessageType and passes a record to its asynchronous logger, if set
+        template <typename MessageType>
+        void log(const element_type<MessageType>& element, bool sending)
+        {
+            if (auto logger = std::get<logger_slot<logger_type<MessageType>>>(logger_).load())
+            {
+                (*logger)(element, sending);
+            }
+
+            if (std::get<logger_slot<async_logger_type<MessageType>>>(async_logger_).is_set())
+            {
+                log_record record;
+                record.type_index = type_index<MessageType>();
+                record.time       = timer::clock::now();
+                record.sending    = sending;
+                if constexpr (std::is_same<element_type<MessageType>, std::shared_ptr<MessageType>>::value)
+                {
+                    record.message = element;
+                }
+                else if constexpr (std::is_copy_constructible<MessageType>::value)
+                {
+                    record.message = std::make_shared<const MessageType>(message_of(element));
+                }
+                log_writer_.push(record);
+            }
+        }
+
+        template <std::size_t... Is>
+        void write_log_record(const log_record& record, std::index_sequence<Is...>)
+        {
+            ((record.type_index == Is ? write_log_record<MessageTypes>(record) : void()), ...);
+        }
+
+        template <typename MessageType>
+        void write_log_record(const log_record& record)
+        {
+            if (auto logger = std::get<logger_slot<async_logger_type<MessageType>>>(async_logger_).load())
+            {
+                (*logger)(*static_cast<const MessageType*>(record.message.get()), record.sending, record.time);
+            }
+        }
+
+        template <std::size_t... Is>
+        std::size_t total_size_helper(std::index_sequence<Is...>) const
+        {
+            return (size<MessageTypes>() + ...);
+        }
+    };
+
+    // Passes all MessageTypes in a single queue of one_of<MessageTypes...>, so messages of different types are received
+    // in the order in which they were sent, and a handler gets them all with one lock acquisition per message. Handlers
+    // are overload sets that are called through one_of::visit. Queue and storage can be selected with
+    // queue_policy<one_of<MessageTypes...>>, and manager() gives access to everything else, e.g. loggers or statistics.
+    template <typename... MessageTypes>
+    class ordered_message_manager
+    {
+        template <typename MessageType>
+        using enable_if_message_type = std::enable_if_t<std::disjunction<std::is_same<MessageType, MessageTypes>...>::value>;
+
+    public:
+        using message_type = one_of<MessageTypes...>;
+        using manager_type = message_manager<message_type>;
+
+        template <typename MessageType, typename = enable_if_message_type<MessageType>>
+        void send_message(MessageType msg, unsigned int max_queued_messages = 0)
+        {
+            manager_.send_message(message_type(std::move(msg)), max_queued_messages);
+        }
+
+        template <typename MessageType, typename = enable_if_message_type<MessageType>>
+        bool try_send_message(MessageType msg, unsigned int max_queued_messages = 0)
+        {
+            return manager_.try_send_message(message_type(std::move(msg)), max_queued_messages);
+        }
+
+        // Sends msg after delay_duration. Its order is the time when it is queued, not when this was called.
+        template <typename MessageType, typename Rep, typename Period, typename = enable_if_message_type<MessageType>>
+        timer::handle send_message(MessageType msg, const std::chrono::duration<Rep, Period>& delay_duration)
+        {
+            return manager_.send_message(message_type(std::move(msg)), delay_duration);
+        }
+
+        // Adds a handler that calls visitor with each message, e.g.
+        // add_visitor(clime::overloaded{[](my_message msg) {}, [](my_other_message msg) {}});
+        template <typename Visitor>
+        void add_visitor(Visitor visitor, const handler_options& options = {})
+        {
+            manager_.template add_handler<message_type>([visitor](message_type message) mutable
+                                                        { std::move(message).visit(visitor); },
+                                                        options);
+        }
+
+        std::optional<message_type> receive_message(bool wait_for_message = false)
+        {
+            return manager_.template receive_message<message_type>(wait_for_message);
+        }
+
+        template <typename Rep, typename Period>
+        std::optional<message_type> receive_message_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return manager_.template receive_message_for<message_type>(timeout);
+        }
+
+        std::size_t size() const { return manager_.template size<message_type>(); }
+
+        void set_capacity(std::size_t capacity, overflow_policy overflow = overflow_policy::block)
+        {
+            manager_.template set_capacity<message_type>(capacity, overflow);
+        }
+
+        void clear_messages() { manager_.template clear_messages<message_type>(); }
+
+        void dispose() { manager_.dispose(); }
+
+        std::size_t shutdown(shutdown_mode mode) { return manager_.shutdown(mode); }
+
+        template <typename Rep, typename Period>
+        std::size_t shutdown(shutdown_mode mode, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return manager_.shutdown(mode, timeout);
+        }
+
+        manager_type&       manager() { return manager_; }
+        const manager_type& manager() const { return manager_; }
+
+    private:
+        manager_type manager_;
+    };
+
+#ifdef CLIME_HAS_COROUTINES
+    // Return type of coroutines that run on their own until they are finished, e.g. consumers that co_await
+    // message_manager::async_receive. Exceptions that leave such a coroutine terminate the application.
+    struct detached_task
+    {
+        struct promise_type
+        {
+            detached_task       get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void               return_void() {}
+            void               unhandled_exception() { std::terminate(); }
+        };
+    };
+#endif
+
+    template <typename Result>
+    class future;
+
+    template <typename Result>
+    future<std::vector<Result>> when_all(const std::vector<future<Result>>& futures);
+
+    template <typename Result>
+    future<std::pair<std::size_t, Result>> when_any(const std::vector<future<Result>>& futures);
+
+    // Result of a function that runs as task of an executor (executor::default_executor() if none is given).
+    // Copies of a future share the same result.
+    template <typename Result>
+    class future
+    {
+    public:
+        future() = default;
+
+        template <typename AsyncOp, typename = std::enable_if_t<!std::is_same<std::decay_t<AsyncOp>, future>::value>>
+        future(const AsyncOp& async_op) // NOLINT(google-explicit-constructor)
+        {
+            start(async_op, executor::default_executor());
+        }
+
+        template <typename AsyncOp>
+        future(const AsyncOp& async_op, executor& task_executor)
+        {
+            start(async_op, task_executor);
+        }
+
+        // Replaces the future function for all copies of this future, the result of a previous one is ignored.
+        template <typename AsyncOp, typename = std::enable_if_t<!std::is_same<std::decay_t<AsyncOp>, future>::value>>
+        future& operator=(const AsyncOp& async_op)
+        {
+            start(async_op, executor::default_executor());
+            return *this;
+        }
+
+        future& operator=(const Result& result) // directly sets results without future function
+        {
+            state_->set(std::make_shared<const Result>(result), nullptr, true);
+            return *this;
+        }
+
+        operator Result() // NOLINT(google-explicit-constructor)
+        {
+            std::unique_lock<std::mutex> lock(state_->mtx);
+            state_->cv.wait(lock, [&]
+                            { return !state_->running || static_cast<bool>(state_->result); });
+            return state_->result ? *state_->result : Result(); // if there is no future function, return default value of its return type
+        }
+
+        bool ready()
+        {
+            std::lock_guard<std::mutex> lock(state_->mtx);
+            return static_cast<bool>(state_->result);
+        }
+
+        // Waits for the result. If the future function has thrown an exception, it is rethrown.
+        std::shared_ptr<const Result> get()
+        {
+            std::unique_lock<std::mutex> lock(state_->mtx);
+            state_->cv.wait(lock, [&]
+                            { return static_cast<bool>(state_->result) || static_cast<bool>(state_->error); });
+            if (!state_->result)
+            {
+                std::rethrow_exception(state_->error);
+            }
+            return state_->result;
+        }
+
+        // Returns a future for the result of continuation(const Result&), which is run as task of task_executor as soon
+        // as this future has its result, so no thread needs to wait for it. If this future fails, so does the returned one.
+        template <typename Continuation>
+        auto then(Continuation continuation, executor& task_executor = executor::default_executor())
+            -> future<std::decay_t<decltype(continuation(std::declval<const Result&>()))>>
+        {
+            using NextResult = std::decay_t<decltype(continuation(std::declval<const Result&>()))>;
+
+            future<NextResult> next;
+            next.state_->running = true;
+            auto next_state      = next.state_;
+
+            state_->on_ready([next_state, continuation, &task_executor](const std::shared_ptr<const Result>& result, std::exception_ptr error)
+                             {
+                                 if (error)
+                                 {
+                                     next_state->set(nullptr, error, false);
+                                     return;
+                                 }
+
+                                 task_executor.submit([next_state, continuation, result]
+                                                      {
+                                                          try
+                                                          {
+                                                              next_state->set(std::make_shared<const NextResult>(continuation(*result)), nullptr, false);
+                                                          }
+                                                          catch (...)
+                                                          {
+                                                              next_state->set(nullptr, std::current_exception(), false);
+                                                          } }); });
+            return next;
+        }
+
+    private:
+        template <typename OtherResult>
+        friend class future;
+
+        template <typename OtherResult>
+        friend future<std::vector<OtherResult>> when_all(const std::vector<future<OtherResult>>& futures);
+
+        template <typename OtherResult>
+        friend future<std::pair<std::size_t, OtherResult>> when_any(const std::vector<future<OtherResult>>& futures);
+
+        using continuation_type = std::function<void(const std::shared_ptr<const Result>& result, std::exception_ptr error)>;
+
+        struct shared_state
+        {
+            std::mutex                     mtx;
+            std::condition_variable        cv;
+            std::shared_ptr<const Result>  result;
+            std::exception_ptr             error;
+            bool                           running{false}; // true while the future function has not finished
+            std::uint64_t                  generation{0};  // of the current future function, see restart
+            std::vector<continuation_type> continuations;
+
+            // Forgets the result for a new future function and returns its generation.
+            std::uint64_t restart()
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                result.reset();
+                error   = nullptr;
+                running = true;
+                return ++generation;
+            }
+
+            // Sets the result (or error) and runs all continuations. If overwrite is false, an already existing result
+            // is kept. While the future function was running, result may have been set by operator=(const Result&).
+            // A result of the future function of another generation than the current one (0 for results that do not
+            // come from a future function) is ignored.
+            void set(std::shared_ptr<const Result> new_result, std::exception_ptr new_error, bool overwrite, std::uint64_t function_generation = 0)
+            {
+                std::vector<continuation_type> ready_continuations;
+                std::shared_ptr<const Result>  current_result;
+                std::exception_ptr             current_error;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (function_generation != 0 && function_generation != generation)
+                    {
+                        return;
+                    }
+                    if (!overwrite)
+                    {
+                        running = false;
+                    }
+
+                    if (overwrite || (!result && !error))
+                    {
+                        result = std::move(new_result);
+                        error  = result ? nullptr : new_error;
+                    }
+                    ready_continuations.swap(continuations);
+                    current_result = result;
+                    current_error  = error;
+                }
+                cv.notify_all();
+
+                for (const auto& continuation : ready_continuations)
+                {
+                    continuation(current_result, current_error);
+                }
+            }
+
+            void on_ready(continuation_type continuation)
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!result && !error)
+                {
+                    continuations.push_back(std::move(continuation));
+                    return;
+                }
+
+                auto current_result = result;
+                auto current_error  = error;
+                lock.unlock();
+                continuation(current_result, current_error);
+            }
+        };
+
+        std::shared_ptr<shared_state> state_ = std::make_shared<shared_state>();
+
+        template <typename AsyncOp>
+        void start(const AsyncOp& async_op, executor& task_executor)
+        {
+            const std::uint64_t generation = state_->restart();
+            task_executor.submit([state = state_, async_op, generation]
+                                 {
+                                     try
+                                     {
+                                         state->set(std::make_shared<const Result>(async_op()), nullptr, false, generation);
+                                     }
+                                     catch (...)
+                                     {
+                                         state->set(nullptr, std::current_exception(), false, generation);
+                                     } });
+        }
+    };
+
+    // Returns a future for the results of all futures. It fails with the first exception of any of them.
+    template <typename Result>
+    future<std::vector<Result>> when_all(const std::vector<future<Result>>& futures)
+    {
+        future<std::vector<Result>> all;
+        auto                        all_state = all.state_;
+
+        if (futures.empty())
+        {
+            all_state->set(std::make_shared<const std::vector<Result>>(), nullptr, true);
+            return all;
+        }
+
+        all_state->running = true;
+        auto results       = std::make_shared<std::vector<std::shared_ptr<const Result>>>(futures.size());
+        auto remaining     = std::make_shared<std::atomic<std::size_t>>(futures.size());
+
+        for (std::size_t i = 0; i < futures.size(); ++i)
+        {
+            futures[i].state_->on_ready([all_state, results, remaining, i](const std::shared_ptr<const Result>& result, std::exception_ptr error)
+                                        {
+                                            if (error)
+                                            {
+                                                all_state->set(nullptr, error, false);
+                                                return;
+                                            }
+
+                                            (*results)[i] = result;
+                                            if (remaining->fetch_sub(1) == 1)
+                                            {
+                                                auto values = std::make_shared<std::vector<Result>>();
+                                                values->reserve(results->size());
+                                                for (const auto& value : *results)
+                                                {
+                                                    values->push_back(*value);
+                                                }
+                                                all_state->set(std::move(values), nullptr, false);
+                                            } });
+        }
+
+        return all;
+    }
+
+    // Returns a future for the index and the result of the first of futures that has its result. It only fails if all
+    // futures fail, so without futures it fails at once with std::invalid_argument.
+    template <typename Result>
+    future<std::pair<std::size_t, Result>> when_any(const std::vector<future<Result>>& futures)
+    {
+        future<std::pair<std::size_t, Result>> any;
+        auto                                   any_state = any.state_;
+        auto                                   failed    = std::make_shared<std::atomic<std::size_t>>(0);
+
+        if (futures.empty())
+        {
+            any_state->set(nullptr, std::make_exception_ptr(std::invalid_argument("when_any needs at least 1 future")), true);
+            return any;
+        }
+        any_state->running = true;
+
+        for (std::size_t i = 0; i < futures.size(); ++i)
+        {
+            futures[i].state_->on_ready([any_state, failed, i, count = futures.size()](const std::shared_ptr<const Result>& result, std::exception_ptr error)
+                                        {
+                                            if (result)
+                                            {
+                                                any_state->set(std::make_shared<const std::pair<std::size_t, Result>>(i, *result), nullptr, false);
+                                            }
+                                            else if (failed->fetch_add(1) + 1 == count)
+                                            {
+                                                any_state->set(nullptr, error, false);
+                                            } });
+        }
+
+        return any;
+    }
+
     class thread_manager
     {
     public:
-        explicit thread_manager(std::function<void()> on_idle, std::function<void(const std::exception& exception)> on_exception = nullptr)
+        explicit thread_manager(std::function<void()>                                on_idle,
+                                std::function<void(const std::exception& exception)> on_exception = nullptr,
+                                const idle_policy&                                   idle         = idle_policy::poll(),
+                                const thread_options&                                thread       = {})
         {
-            message_manager_.add_handler<int>(nullptr, std::move(on_exception), std::move(on_idle));
+            message_manager_.add_handler<int>(nullptr, std::move(on_exception), std::move(on_idle), nullptr, "", idle, thread);
         }
 
     private:
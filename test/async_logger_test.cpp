@@ -0,0 +1,100 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+
+// Checks that an asynchronous logger gets every record soon, also after the log writer has been idle, and that the
+// idle log writer sleeps instead of waking up periodically.
+
+struct event
+{
+    int number;
+};
+
+template <typename Condition>
+bool wait_until(Condition condition)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!condition() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return condition();
+}
+
+#ifdef __linux__
+// number of times the thread named clime_logger has gone to sleep, -1 if there is no such thread
+long log_writer_switches()
+{
+    DIR* tasks = ::opendir("/proc/self/task");
+    if (tasks == nullptr)
+    {
+        return -1;
+    }
+
+    long switches = -1;
+    while (const dirent* task = ::readdir(tasks))
+    {
+        const std::string path = std::string("/proc/self/task/") + task->d_name;
+        std::string       name;
+        std::ifstream(path + "/comm") >> name;
+        if (name != "clime_logger")
+        {
+            continue;
+        }
+
+        std::ifstream status(path + "/status");
+        for (std::string line; std::getline(status, line);)
+        {
+            if (line.rfind("voluntary_ctxt_switches:", 0) == 0)
+            {
+                switches = std::stol(line.substr(line.find(':') + 1));
+            }
+        }
+    }
+    ::closedir(tasks);
+    return switches;
+}
+#endif
+
+int main()
+{
+    clime::message_manager<event> mm;
+    std::atomic<int>              logged{0};
+    mm.set_async_logger<event>([&logged](const event&, bool sending, clime::timer::clock::time_point)
+                               {
+                                   if (sending)
+                                   {
+                                       ++logged;
+                                   }
+                               });
+
+    for (int i = 0; i < 100; ++i)
+    {
+        mm.send_message(event{i});
+    }
+    assert(wait_until([&]
+                      { return logged == 100; }));
+
+#ifdef __linux__
+    // polling every millisecond would wake the thread about 200 times
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const long before = log_writer_switches();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const long after = log_writer_switches();
+    assert(before >= 0 && after - before < 10);
+#endif
+
+    // a sleeping log writer is woken by the next record
+    for (int round = 0; round < 100; ++round)
+    {
+        mm.send_message(event{round});
+        assert(wait_until([&]
+                          { return logged == 101 + round; }));
+    }
+
+    std::cout << "async_logger_test passed" << std::endl;
+    return 0;
+}
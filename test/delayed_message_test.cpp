@@ -0,0 +1,96 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <iostream>
+
+// Checks that delayed messages are sent in every storage form and that a full queue does not stall the timer thread,
+// which sends the delayed messages of all types.
+
+struct slow
+{
+    int number;
+};
+
+struct tick
+{
+    int number;
+};
+
+using manager = clime::message_manager<slow, tick>;
+
+template <typename Condition>
+bool wait_until(Condition condition)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!condition() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return condition();
+}
+
+void test_storage_forms()
+{
+    manager          mm;
+    std::atomic<int> sum{0};
+    mm.add_handler<tick>([&sum](std::shared_ptr<tick> msg)
+                         { sum += msg->number; });
+
+    mm.send_message(std::make_shared<tick>(tick{1}), std::chrono::milliseconds(1));
+    mm.send_message(std::make_unique<tick>(tick{2}), std::chrono::milliseconds(1));
+    mm.send_message(tick{4}, std::chrono::milliseconds(1));
+    mm.send_message_at(tick{8}, std::chrono::steady_clock::now() + std::chrono::milliseconds(1));
+    assert(wait_until([&]
+                      { return sum == 15; }));
+
+    auto handle = mm.send_message(tick{16}, std::chrono::seconds(10));
+    assert(handle.cancel());
+}
+
+// a delayed message for a full queue is dropped, the delayed messages of other types are still sent
+void test_full_queue()
+{
+    manager          mm;
+    std::atomic<int> ticks{0};
+    mm.add_handler<tick>([&ticks](std::shared_ptr<tick>)
+                         { ++ticks; });
+
+    mm.set_capacity<slow>(1, clime::overflow_policy::block);
+    mm.send_message(slow{1});
+    mm.send_message(slow{2}, std::chrono::milliseconds(1));
+    mm.send_message(tick{1}, std::chrono::milliseconds(20));
+
+    assert(wait_until([&]
+                      { return ticks == 1; }));
+    assert(mm.dropped_delayed_messages() == 1);
+    assert(mm.size<slow>() == 1);
+    assert(mm.receive_message<slow>()->number == 1);
+}
+
+void test_drop_oldest()
+{
+    manager          mm;
+    std::atomic<int> ticks{0};
+    mm.add_handler<tick>([&ticks](std::shared_ptr<tick>)
+                         { ++ticks; });
+
+    mm.set_capacity<slow>(1, clime::overflow_policy::drop_oldest);
+    mm.send_message(slow{1});
+    mm.send_message(slow{2}, std::chrono::milliseconds(1));
+    mm.send_message(tick{1}, std::chrono::milliseconds(20)); // sent after slow{2}
+
+    assert(wait_until([&]
+                      { return ticks == 1; }));
+    assert(mm.dropped_delayed_messages() == 0);
+    assert(mm.size<slow>() == 1);
+    assert(mm.receive_message<slow>()->number == 2);
+}
+
+int main()
+{
+    test_storage_forms();
+    test_full_queue();
+    test_drop_oldest();
+    std::cout << "delayed_message_test passed" << std::endl;
+    return 0;
+}
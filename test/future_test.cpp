@@ -0,0 +1,119 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <iostream>
+
+// Checks that copies of clime::future share one result, also when a new function is assigned, and that when_all and
+// when_any complete for any number of futures.
+
+void test_copies_share_result()
+{
+    clime::future<int> f = []
+    { return 1; };
+    clime::future<int> copy = f;
+    assert(*copy.get() == 1);
+
+    f = []
+    { return 2; };
+    assert(*copy.get() == 2);
+    assert(*f.get() == 2);
+
+    copy = 3;
+    assert(*f.get() == 3);
+}
+
+// the result of a function that is still running when another one is assigned is ignored
+void test_previous_function_ignored()
+{
+    clime::executor    workers(2); // the default executor may have a single worker, which the first function occupies
+    std::atomic<bool>  release{false};
+    clime::future<int> f([&release]
+                         {
+                             while (!release)
+                             {
+                                 std::this_thread::yield();
+                             }
+                             return 1; },
+                         workers);
+    clime::future<int> copy = f;
+
+    f = []
+    { return 2; };
+    assert(*copy.get() == 2);
+
+    release = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(*copy.get() == 2);
+}
+
+void test_then()
+{
+    clime::future<int> f = []
+    { return 20; };
+    auto next = f.then([](const int& value)
+                       { return value + 1; });
+    assert(*next.get() == 21);
+
+    clime::future<int> failing = []() -> int
+    { throw std::runtime_error("failed"); };
+    auto failed = failing.then([](const int& value)
+                               { return value; });
+    bool thrown = false;
+    try
+    {
+        failed.get();
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void test_when_all()
+{
+    std::vector<clime::future<int>> futures;
+    for (int i = 0; i < 4; ++i)
+    {
+        futures.emplace_back([i]
+                             { return i; });
+    }
+    assert(*clime::when_all(futures).get() == (std::vector<int>{0, 1, 2, 3}));
+    assert(clime::when_all(std::vector<clime::future<int>>()).get()->empty());
+}
+
+void test_when_any()
+{
+    std::vector<clime::future<int>> futures;
+    futures.emplace_back([]() -> int
+                         { throw std::runtime_error("failed"); });
+    futures.emplace_back([]
+                         { return 7; });
+    const auto first = clime::when_any(futures).get();
+    assert(first->first == 1 && first->second == 7);
+
+    auto none   = clime::when_any(std::vector<clime::future<int>>());
+    bool thrown = false;
+    try
+    {
+        none.get();
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    using index_and_result = std::pair<std::size_t, int>;
+    assert(static_cast<index_and_result>(none).second == 0); // does not wait either
+}
+
+int main()
+{
+    test_copies_share_result();
+    test_previous_function_ignored();
+    test_then();
+    test_when_all();
+    test_when_any();
+    std::cout << "future_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+// Checks that clime::journaled_queue_policy replays the messages that were not acknowledged after a restart, deletes
+// the segments whose messages have all been acknowledged, and moves messages whose handler keeps throwing to the dead
+// letters instead of keeping them and all later messages in the journal. With the argument "write" or "read", it only
+// writes a journal or reads it, so that a journal can be passed to a build with another CLIME_ENABLE_STATS.
+
+constexpr int segment_messages = 8;
+constexpr int max_attempts     = 3;
+constexpr int message_count    = 20;
+
+struct order
+{
+    int id;
+};
+
+struct order_journal
+{
+    static constexpr const char* path = "journal_test_orders"; // in the working directory of the test
+};
+
+template <>
+struct clime::storage_policy<order> : clime::inline_storage
+{
+};
+
+template <>
+struct clime::queue_policy<order> : clime::journaled_queue_policy<segment_messages, order_journal, 0, max_attempts>
+{
+};
+
+using manager = clime::message_manager<order>;
+
+bool segment_exists(int segment)
+{
+    struct stat st;
+    return ::stat((std::string(order_journal::path) + "." + std::to_string(segment)).c_str(), &st) == 0;
+}
+
+void send_all(manager& mm)
+{
+    for (int i = 0; i < message_count; ++i)
+    {
+        mm.send_message(order{i});
+    }
+}
+
+template <typename Condition>
+void wait_until(Condition condition)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (!condition() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void test_restart()
+{
+    clime::remove_journal(order_journal::path);
+    {
+        manager mm;
+        send_all(mm);
+        assert(mm.size<order>() == message_count);
+    }
+
+    // acknowledges the first 10 messages and receives 3 more without acknowledging them
+    {
+        manager mm;
+        assert(mm.size<order>() == message_count);
+        for (int i = 0; i < 10; ++i)
+        {
+            auto msg = mm.receive_message<order>();
+            assert(msg && msg->id == i);
+        }
+        mm.acknowledge<order>();
+        assert(!segment_exists(0)); // all its messages have been acknowledged
+        assert(segment_exists(1));
+        for (int i = 10; i < 13; ++i)
+        {
+            assert(mm.receive_message<order>());
+        }
+    }
+
+    {
+        manager mm;
+        assert(mm.size<order>() == message_count - 10);
+        for (int i = 10; i < message_count; ++i)
+        {
+            auto msg = mm.receive_message<order>();
+            assert(msg && msg->id == i);
+        }
+        assert(!mm.receive_message<order>());
+        mm.acknowledge<order>();
+        assert(!segment_exists(1));
+    }
+
+    {
+        manager mm;
+        assert(mm.size<order>() == 0);
+    }
+    clime::remove_journal(order_journal::path);
+}
+
+void test_failed_once()
+{
+    clime::remove_journal(order_journal::path);
+    {
+        manager          mm;
+        std::atomic<int> handled{0};
+        std::atomic<int> failures{0};
+        clime::handler_options options;
+        options.on_exception = [&failures](const std::exception&)
+        { ++failures; };
+        mm.add_handler<order>([&handled, failed = false](order msg) mutable
+                              {
+                                  if (msg.id == 5 && !failed)
+                                  {
+                                      failed = true;
+                                      throw std::runtime_error("failed once");
+                                  }
+                                  ++handled; },
+                              options);
+        send_all(mm);
+        wait_until([&]
+                   { return handled == message_count; });
+        assert(handled == message_count);
+        assert(failures == 1);
+        assert(mm.dead_letters<order>().empty());
+    }
+    {
+        manager mm;
+        assert(mm.size<order>() == 0);
+    }
+    clime::remove_journal(order_journal::path);
+}
+
+void test_poison_message()
+{
+    clime::remove_journal(order_journal::path);
+    {
+        manager          mm;
+        std::atomic<int> handled{0};
+        std::atomic<int> attempts{0};
+        mm.add_handler<order>([&handled, &attempts](order msg)
+                              {
+                                  if (msg.id == 3)
+                                  {
+                                      ++attempts;
+                                      throw std::runtime_error("poison");
+                                  }
+                                  ++handled; },
+                              clime::handler_options());
+        send_all(mm);
+        wait_until([&]
+                   { return handled == message_count - 1 && mm.dead_letters<order>().size() == 1; });
+        assert(handled == message_count - 1);
+        assert(attempts == max_attempts);
+
+        const auto letters = mm.dead_letters<order>();
+        assert(letters.size() == 1 && letters.front().id == 3);
+        assert(!segment_exists(0) && !segment_exists(1)); // the poison message does not keep the segments
+    }
+
+    // nothing is replayed, but the dead letter is kept
+    {
+        manager mm;
+        assert(mm.size<order>() == 0);
+        assert(mm.dead_letters<order>().size() == 1);
+    }
+    clime::remove_journal(order_journal::path);
+    {
+        manager mm;
+        assert(mm.dead_letters<order>().empty());
+    }
+    clime::remove_journal(order_journal::path);
+}
+
+// the layout of the journal does not depend on CLIME_ENABLE_STATS
+void write_journal()
+{
+    clime::remove_journal(order_journal::path);
+    manager mm;
+    send_all(mm);
+}
+
+void read_journal()
+{
+    {
+        manager mm;
+        assert(mm.size<order>() == message_count);
+        for (int i = 0; i < message_count; ++i)
+        {
+            auto msg = mm.receive_message<order>();
+            assert(msg && msg->id == i);
+        }
+        mm.acknowledge<order>();
+#ifdef CLIME_ENABLE_STATS
+        assert(mm.stats<order>().dequeued == message_count);
+#endif
+    }
+    clime::remove_journal(order_journal::path);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        if (std::strcmp(argv[1], "write") == 0)
+        {
+            write_journal();
+        }
+        else
+        {
+            read_journal();
+        }
+        return 0;
+    }
+
+    test_restart();
+    test_failed_once();
+    test_poison_message();
+    std::cout << "journal_test passed" << std::endl;
+    return 0;
+}
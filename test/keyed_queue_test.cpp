@@ -0,0 +1,236 @@
+#include "clime.hpp"
+
+#include <array>
+#include <cassert>
+#include <iostream>
+#include <vector>
+
+// Checks that clime::keyed_queue_policy receives every message and never handles two messages with the same key in
+// parallel or out of order, with any number of handlers up to the number of shards.
+
+constexpr int shards        = 4;
+constexpr int producers     = 2;
+constexpr int keys          = 64; // per producer
+constexpr int message_count = 40000;
+
+struct keyed
+{
+    int key;
+    int sequence; // per key
+};
+
+struct keyed_key
+{
+    int operator()(const keyed& msg) const { return msg.key; }
+};
+
+template <>
+struct clime::queue_policy<keyed> : clime::keyed_queue_policy<shards, keyed_key>
+{
+};
+
+template <>
+struct clime::storage_policy<keyed> : clime::inline_storage
+{
+};
+
+// records what the handlers received
+struct receipts
+{
+    std::array<std::atomic<int>, producers * keys> next{};   // sequence expected next per key
+    std::array<std::atomic<int>, producers * keys> active{}; // handlers that handle a message of the key
+    std::atomic<int>                               received{0};
+    std::atomic<int>                               errors{0};
+
+    void handle(const keyed& msg)
+    {
+        if (active[msg.key]++ != 0 || next[msg.key].load() != msg.sequence)
+        {
+            ++errors;
+        }
+        next[msg.key] = msg.sequence + 1;
+        std::this_thread::yield(); // gives other handlers a chance to take the same key
+        --active[msg.key];
+        ++received;
+    }
+
+    void wait_for(int count) const
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        while (received < count && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+};
+
+void send_all(clime::message_manager<keyed>& mm)
+{
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&mm, p]
+                             {
+                                 std::array<int, keys> sequences{};
+                                 for (int i = 0; i < message_count / producers; ++i)
+                                 {
+                                     const int key = i % keys;
+                                     mm.send_message(keyed{p * keys + key, sequences[key]++});
+                                 } });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void test_handler_counts()
+{
+    for (int handlers = 1; handlers <= shards; ++handlers)
+    {
+        clime::message_manager<keyed> mm;
+        receipts                      r;
+        for (int i = 0; i < handlers; ++i)
+        {
+            mm.add_handler<keyed>([&r](keyed msg)
+                                  { r.handle(msg); });
+        }
+        send_all(mm);
+        r.wait_for(message_count);
+        assert(r.received == message_count);
+        assert(r.errors == 0);
+        assert(mm.size<keyed>() == 0);
+    }
+}
+
+void test_too_many_handlers()
+{
+    clime::message_manager<keyed> mm;
+    for (int i = 0; i < shards; ++i)
+    {
+        mm.add_handler<keyed>([](keyed) {});
+    }
+
+    bool thrown = false;
+    try
+    {
+        mm.add_handler<keyed>([](keyed) {});
+    }
+    catch (const std::length_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // the handlers can be replaced by others
+    mm.clear_handlers<keyed>();
+    for (int i = 0; i < shards; ++i)
+    {
+        mm.add_handler<keyed>([](keyed) {});
+    }
+}
+
+void test_handlers_added_while_sending()
+{
+    clime::message_manager<keyed> mm;
+    receipts                      r;
+    mm.add_handler<keyed>([&r](keyed msg)
+                          { r.handle(msg); });
+
+    std::thread sender([&mm]
+                       { send_all(mm); });
+    for (int i = 1; i < shards; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        mm.add_handler<keyed>([&r](keyed msg)
+                              { r.handle(msg); });
+    }
+    sender.join();
+
+    r.wait_for(message_count);
+    assert(r.received == message_count);
+    assert(r.errors == 0);
+}
+
+void test_task_handlers()
+{
+    clime::message_manager<keyed> mm;
+    receipts                      r;
+    clime::handler_options        options;
+    options.task_executor = &clime::executor::default_executor();
+    mm.add_handler<keyed>([&r](keyed msg)
+                          { r.handle(msg); },
+                          options);
+    mm.add_handler<keyed>([&r](keyed msg)
+                          { r.handle(msg); });
+    mm.add_handler<keyed>([&r](keyed msg)
+                          { r.handle(msg); },
+                          options);
+
+    send_all(mm);
+    r.wait_for(message_count);
+    assert(r.received == message_count);
+    assert(r.errors == 0);
+}
+
+// the shards of one manager do not depend on the handlers of another one
+void test_two_managers()
+{
+    clime::message_manager<keyed> first;
+    clime::message_manager<keyed> second;
+    receipts                      first_receipts;
+    receipts                      second_receipts;
+    for (int i = 0; i < shards; ++i)
+    {
+        first.add_handler<keyed>([&first_receipts](keyed msg)
+                                 { first_receipts.handle(msg); });
+    }
+    second.add_handler<keyed>([&second_receipts](keyed msg)
+                              { second_receipts.handle(msg); });
+
+    std::thread other([&second]
+                      { send_all(second); });
+    send_all(first);
+    other.join();
+
+    first_receipts.wait_for(message_count);
+    second_receipts.wait_for(message_count);
+    assert(first_receipts.received == message_count && first_receipts.errors == 0);
+    assert(second_receipts.received == message_count && second_receipts.errors == 0);
+}
+
+void test_without_handlers()
+{
+    clime::message_manager<keyed> mm;
+    for (int i = 0; i < 100; ++i)
+    {
+        mm.send_message(keyed{i, 0});
+    }
+
+    int received = 0;
+    while (mm.receive_message<keyed>())
+    {
+        ++received;
+    }
+    assert(received == 100);
+
+    // drop_oldest makes space in any shard
+    mm.set_capacity<keyed>(10, clime::overflow_policy::drop_oldest);
+    for (int i = 0; i < 100; ++i)
+    {
+        mm.send_message(keyed{i, 0});
+    }
+    assert(mm.size<keyed>() == 10);
+}
+
+int main()
+{
+    test_handler_counts();
+    test_too_many_handlers();
+    test_handlers_added_while_sending();
+    test_task_handlers();
+    test_two_managers();
+    test_without_handlers();
+    std::cout << "keyed_queue_test passed" << std::endl;
+    return 0;
+}
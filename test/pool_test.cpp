@@ -0,0 +1,88 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <iostream>
+
+// Checks that a block_pool reuses blocks of every size class, that larger and over-aligned blocks bypass it and that
+// message_manager::acquire works for such message types.
+
+struct small
+{
+    int value;
+};
+
+struct large
+{
+    char bytes[4096];
+};
+
+struct alignas(64) aligned
+{
+    int value;
+};
+
+void test_size_classes()
+{
+    clime::block_pool pool;
+    void*             a = pool.allocate(8);
+    void*             b = pool.allocate(200);
+    pool.deallocate(a, 8);
+    pool.deallocate(b, 200);
+    assert(pool.available() == 2);
+
+    // blocks of the same size class are reused, whichever size was requested first
+    assert(pool.allocate(16) == a);
+    assert(pool.allocate(180) == b);
+    assert(pool.available() == 0);
+    pool.deallocate(a, 16);
+    pool.deallocate(b, 180);
+}
+
+void test_bypass()
+{
+    clime::block_pool pool;
+    void*             big = pool.allocate(clime::block_pool::max_block_size + 1);
+    pool.deallocate(big, clime::block_pool::max_block_size + 1);
+
+    void* over_aligned = pool.allocate(64, 64);
+    assert(reinterpret_cast<std::uintptr_t>(over_aligned) % 64 == 0);
+    pool.deallocate(over_aligned, 64, 64);
+    assert(pool.available() == 0);
+}
+
+void test_acquire()
+{
+    clime::message_manager<small, large, aligned> mm;
+    std::atomic<int>                              handled{0};
+    mm.add_handler<small>([&handled](std::shared_ptr<small>)
+                          { ++handled; });
+    mm.add_handler<large>([&handled](std::shared_ptr<large>)
+                          { ++handled; });
+    mm.add_handler<aligned>([&handled](std::shared_ptr<aligned> msg)
+                            {
+                                assert(reinterpret_cast<std::uintptr_t>(msg.get()) % 64 == 0);
+                                ++handled; });
+
+    for (int i = 0; i < 10; ++i)
+    {
+        mm.send_message(mm.acquire<small>(small{i}));
+        mm.send_message(mm.acquire<large>());
+        mm.send_message(mm.acquire<aligned>(aligned{i}));
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (handled < 30 && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assert(handled == 30);
+}
+
+int main()
+{
+    test_size_classes();
+    test_bypass();
+    test_acquire();
+    std::cout << "pool_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <iostream>
+
+// Checks that requests time out, that late replies are dropped, that the slots of a call type are reused and, with
+// C++20, that a coroutine that is destroyed while it waits for a reply is not resumed by the next user of its slot.
+
+struct question
+{
+    int value;
+};
+
+struct answer
+{
+    int value;
+};
+
+using ask     = clime::call<question, answer, 1>; // a single slot, so every request reuses it
+using manager = clime::message_manager<ask>;
+
+void test_reply()
+{
+    manager mm;
+    mm.add_responder<question, answer>([](const question& q)
+                                       { return answer{q.value * 2}; });
+    for (int i = 0; i < 100; ++i)
+    {
+        auto reply = mm.request<question, answer>(question{i}, std::chrono::seconds(10));
+        assert(reply.get()->value == i * 2);
+    }
+}
+
+void test_timeout()
+{
+    manager mm;
+
+    // without a responder, the request times out
+    const auto start = std::chrono::steady_clock::now();
+    auto       reply = mm.request<question, answer>(question{1}, std::chrono::milliseconds(20));
+    assert(!reply.get());
+    assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+    // the responder gets the queued request, but its reply is dropped, while the next request of the slot is answered
+    mm.add_responder<question, answer>([](const question& q)
+                                       { return answer{q.value}; });
+    auto next = mm.request<question, answer>(question{2}, std::chrono::seconds(10));
+    assert(next.get()->value == 2);
+}
+
+void test_all_slots_in_use()
+{
+    manager mm;
+    auto    first  = mm.request<question, answer>(question{1}, std::chrono::seconds(10));
+    auto    second = mm.request<question, answer>(question{2}, std::chrono::seconds(10));
+    assert(first.valid());
+    assert(!second.valid() && !second.get());
+}
+
+void test_responder_throws()
+{
+    manager mm;
+    mm.add_responder<question, answer>([](const question&) -> answer
+                                       { throw std::runtime_error("no answer"); });
+    auto reply  = mm.request<question, answer>(question{1}, std::chrono::seconds(10));
+    bool thrown = false;
+    try
+    {
+        reply.get();
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void test_dispose()
+{
+    manager mm;
+    auto    reply = mm.request<question, answer>(question{1});
+    std::thread disposer([&mm]
+                         {
+                             std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                             mm.dispose(); });
+    assert(!reply.get());
+    disposer.join();
+}
+
+#ifdef CLIME_HAS_COROUTINES
+// a coroutine whose frame is destroyed by its owner
+struct owned_task
+{
+    struct promise_type
+    {
+        owned_task          get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_never  initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void                return_void() {}
+        void                unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+owned_task await_reply(manager& mm, std::atomic<int>& resumed)
+{
+    auto reply = co_await mm.request<question, answer>(question{1});
+    static_cast<void>(reply);
+    ++resumed;
+}
+
+void test_destroyed_coroutine()
+{
+    manager          mm;
+    std::atomic<int> resumed{0};
+
+    // waits without a responder, then gives up its slot when it is destroyed
+    owned_task waiting = await_reply(mm, resumed);
+    assert(!waiting.handle.done());
+    waiting.handle.destroy();
+
+    mm.add_responder<question, answer>([](const question& q)
+                                       { return answer{q.value}; });
+    for (int i = 0; i < 10; ++i)
+    {
+        auto reply = mm.request<question, answer>(question{i}, std::chrono::seconds(10));
+        assert(reply.get()->value == i);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10)); // a stale continuation would be resumed by the default executor
+    assert(resumed == 0);
+}
+#endif
+
+int main()
+{
+    test_reply();
+    test_timeout();
+    test_all_slots_in_use();
+    test_responder_throws();
+    test_dispose();
+#ifdef CLIME_HAS_COROUTINES
+    test_destroyed_coroutine();
+#endif
+    std::cout << "request_reply_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Checks that clime::shared_memory_queue_policy passes messages between processes in order, also when the ring is full
+// and the sender has to wait for the receiver, and that queued messages survive the manager that sent them.
+
+constexpr int capacity      = 8;
+constexpr int message_count = 10000;
+
+struct tick
+{
+    int number;
+};
+
+struct tick_segment
+{
+    static constexpr const char* name = "/clime_shared_memory_test";
+};
+
+template <>
+struct clime::storage_policy<tick> : clime::inline_storage
+{
+};
+
+template <>
+struct clime::queue_policy<tick> : clime::shared_memory_queue_policy<capacity, tick_segment>
+{
+};
+
+using manager = clime::message_manager<tick>;
+
+// runs before the test process has started any thread, so that the child may use the heap
+void test_other_process()
+{
+    const pid_t child = ::fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        {
+            manager mm;
+            for (int i = 0; i < message_count; ++i)
+            {
+                mm.send_message(tick{i}); // waits whenever the ring is full
+            }
+        }
+        ::_exit(0);
+    }
+
+    {
+        manager          mm;
+        std::atomic<int> next{0};
+        std::atomic<int> out_of_order{0};
+        mm.add_handler<tick>([&](const tick& msg)
+                             {
+                                 if (msg.number != next)
+                                 {
+                                     ++out_of_order;
+                                 }
+                                 next = msg.number + 1; });
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        while (next < message_count && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(next == message_count);
+        assert(out_of_order == 0);
+    }
+
+    int status = 0;
+    assert(::waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void test_messages_survive_sender()
+{
+    {
+        manager mm;
+        for (int i = 0; i < capacity; ++i)
+        {
+            assert(mm.try_send_message(tick{i}));
+        }
+        assert(!mm.try_send_message(tick{capacity}));
+    }
+
+    manager mm;
+    assert(mm.size<tick>() == capacity);
+    for (int i = 0; i < capacity; ++i)
+    {
+        auto msg = mm.receive_message<tick>();
+        assert(msg && msg->number == i);
+    }
+    assert(!mm.receive_message<tick>());
+}
+
+int main()
+{
+    clime::remove_shared_memory(tick_segment::name);
+    test_other_process();
+    test_messages_survive_sender();
+    clime::remove_shared_memory(tick_segment::name);
+    std::cout << "shared_memory_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <iostream>
+
+// Checks that clime::apply_thread_options accepts real-time policies without a priority and reports priorities out of
+// the range of the policy as EINVAL.
+
+// applies options on a thread of its own, so that the test runs with the default scheduling
+std::error_code apply_on_thread(const clime::thread_options& options)
+{
+    std::error_code result;
+    std::thread     thread([&]
+                       { result = clime::apply_thread_options(options); });
+    thread.join();
+    return result;
+}
+
+void test_default_priority()
+{
+    for (const auto policy : {clime::thread_options::scheduling::fifo, clime::thread_options::scheduling::round_robin})
+    {
+        clime::thread_options options;
+        options.policy = policy;
+
+        // without privileges, the policy cannot be applied, but the priority is valid
+        const std::error_code error = apply_on_thread(options);
+        assert(!error || error.value() == EPERM);
+    }
+}
+
+void test_invalid_priority()
+{
+    for (const int priority : {-1, 1000})
+    {
+        clime::thread_options options;
+        options.policy   = clime::thread_options::scheduling::fifo;
+        options.priority = priority;
+        assert(apply_on_thread(options).value() == EINVAL);
+    }
+}
+
+int main()
+{
+#ifdef __linux__
+    test_default_priority();
+    test_invalid_priority();
+#endif
+    std::cout << "thread_options_test passed" << std::endl;
+    return 0;
+}
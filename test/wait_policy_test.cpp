@@ -0,0 +1,63 @@
+#include "clime.hpp"
+
+#include <cassert>
+#include <ctime>
+#include <iostream>
+
+// Checks that receivers of a message type with a spinning wait_policy spin before they sleep, whether they receive
+// single messages or batches.
+
+struct spinning
+{
+    int number;
+};
+
+template <>
+struct clime::wait_policy<spinning> : clime::spin_wait_policy<clime::wait_strategy::busy_spin>
+{
+};
+
+using manager = clime::message_manager<spinning>;
+
+std::chrono::nanoseconds thread_cpu_time()
+{
+    timespec time{};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+}
+
+// runs receive on a thread of its own and returns the CPU time that this thread used while it waited for a message
+// sent after 50 ms
+template <typename Receive>
+std::chrono::nanoseconds cpu_time_while_waiting(manager& mm, Receive receive)
+{
+    std::chrono::nanoseconds used{};
+    std::thread              receiver([&]
+                         {
+                             const auto start = thread_cpu_time();
+                             receive();
+                             used = thread_cpu_time() - start; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    mm.send_message(spinning{1});
+    receiver.join();
+    return used;
+}
+
+int main()
+{
+    manager mm;
+
+    const auto single = cpu_time_while_waiting(mm, [&mm]
+                                               { assert(mm.receive_message<spinning>(true)->number == 1); });
+    assert(single >= std::chrono::milliseconds(10));
+
+    const auto batch = cpu_time_while_waiting(mm, [&mm]
+                                              {
+                                                  std::vector<std::shared_ptr<spinning>> received;
+                                                  assert(mm.receive_messages<spinning>(std::back_inserter(received), 10, true) == 1);
+                                                  assert(received.front()->number == 1); });
+    assert(batch >= std::chrono::milliseconds(10));
+
+    std::cout << "wait_policy_test passed" << std::endl;
+    return 0;
+}